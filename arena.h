@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "logging.h"
+
+namespace chess {
+
+// Owns objects of type T, addressed by index.
+//
+// Objects sit contiguously in fixed-size blocks that never move, so indices
+// and references stay valid for the life of the arena. Nothing is freed
+// individually: destroying the arena destroys every object in one linear pass
+// and releases the blocks. Allocation is thread-safe; as usual, an index handed
+// to another thread must be published with some synchronization. Running out
+// of room aborts, in every build.
+template <typename T>
+class Arena {
+ public:
+  using Index = uint32_t;
+  static constexpr Index kNone = ~Index{0};
+
+  Arena() : blocks(kMaxBlocks, nullptr) {}
+
+  ~Arena() {
+    for (Index i = 0; i < next; i++) {
+      (*this)[i].~T();
+    }
+    for (Block *block : blocks) {
+      delete block;
+    }
+  }
+
+  // Construct a new object and return its index. Only claiming the slot is
+  // serialized; the constructor runs outside the lock.
+  template <typename... Args>
+  Index emplace(Args &&... args) {
+    Index index;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (next / kBlockSize >= kMaxBlocks) {
+        CHESS_LOG(ERROR) << "Arena full at " << next << " objects";
+        Logger::global().flush();
+        std::abort();
+      }
+      index = next++;
+      if (index % kBlockSize == 0) {
+        blocks[index / kBlockSize] = new Block;
+      }
+    }
+    new (slot(index)) T(std::forward<Args>(args)...);
+    return index;
+  }
+
+  T &operator[](Index index) { return *reinterpret_cast<T *>(slot(index)); }
+  const T &operator[](Index index) const {
+    return *reinterpret_cast<const T *>(slot(index));
+  }
+
+ private:
+  static constexpr Index kBlockSize = 256;
+  static constexpr Index kMaxBlocks = 1 << 14;
+
+  struct Block {
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type
+        slots[kBlockSize];
+  };
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  void *slot(Index index) const {
+    return &blocks[index / kBlockSize]->slots[index % kBlockSize];
+  }
+
+  // Sized up front, so looking up a block never races with adding one.
+  std::vector<Block *> blocks;
+
+  std::mutex mutex;
+  Index next = 0;
+};
+
+template <typename T>
+constexpr typename Arena<T>::Index Arena<T>::kNone;
+
+}  // namespace chess
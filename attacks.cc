@@ -0,0 +1,180 @@
+#include "attacks.h"
+
+#include <cstddef>
+
+namespace chess {
+
+namespace {
+
+const int kRookDirections[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+const int kBishopDirections[4][2] = {{1, 1}, {1, -1}, {-1, 1}, {-1, -1}};
+const int kKingDirections[8][2] = {{1, 0}, {-1, 0}, {0, 1},  {0, -1},
+                                   {1, 1}, {1, -1}, {-1, 1}, {-1, -1}};
+const int kKnightOffsets[8][2] = {{2, 1},  {2, -1}, {-2, 1}, {-2, -1},
+                                  {1, 2},  {1, -2}, {-1, 2}, {-1, -2}};
+
+bool on_board(int rank, int file) {
+  return 0 <= rank && rank < 8 && 0 <= file && file < 8;
+}
+
+// Walk every ray from `square` until it leaves the board or reaches a square
+// in `blockers`, which is included.
+Bitboard slide(int square, const int (&directions)[4][2], Bitboard blockers) {
+  Bitboard result = 0;
+  for (const auto &d : directions) {
+    int rank = square / 8 + d[0], file = square % 8 + d[1];
+    while (on_board(rank, file)) {
+      Bitboard bit = square_bb(rank, file);
+      result |= bit;
+      if (blockers & bit) {
+        break;
+      }
+      rank += d[0];
+      file += d[1];
+    }
+  }
+  return result;
+}
+
+// The squares whose occupancy can change a slide from `square`: every ray
+// without its final square.
+Bitboard relevant_mask(int square, const int (&directions)[4][2]) {
+  Bitboard result = 0;
+  for (const auto &d : directions) {
+    int rank = square / 8 + d[0], file = square % 8 + d[1];
+    while (on_board(rank + d[0], file + d[1])) {
+      result |= square_bb(rank, file);
+      rank += d[0];
+      file += d[1];
+    }
+  }
+  return result;
+}
+
+#if !defined(__BMI2__)
+// Per-rank seeds that keep the magic search short.
+const uint64_t kMagicSeeds[8] = {728,   10316, 55013, 32803,
+                                 12281, 15100, 16645, 255};
+
+// xorshift64*, with a fixed seed so every run finds the same magics.
+class MagicRng {
+ public:
+  explicit MagicRng(uint64_t seed) : state(seed) {}
+
+  Bitboard next() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+  }
+
+  // Candidates with few bits set make good magics.
+  Bitboard sparse() { return next() & next() & next(); }
+
+ private:
+  uint64_t state;
+};
+#endif
+
+}  // namespace
+
+AttackTables::AttackTables() {
+  for (int square = 0; square < 64; square++) {
+    int rank = square / 8, file = square % 8;
+
+    knight_attacks[square] = 0;
+    for (const auto &d : kKnightOffsets) {
+      if (on_board(rank + d[0], file + d[1])) {
+        knight_attacks[square] |= square_bb(rank + d[0], file + d[1]);
+      }
+    }
+
+    king_attacks[square] = 0;
+    between_squares[square].fill(0);
+    for (const auto &d : kKingDirections) {
+      if (on_board(rank + d[0], file + d[1])) {
+        king_attacks[square] |= square_bb(rank + d[0], file + d[1]);
+      }
+
+      Bitboard path = 0;
+      for (int r = rank + d[0], f = file + d[1]; on_board(r, f);
+           r += d[0], f += d[1]) {
+        between_squares[square][square_index(r, f)] = path;
+        path |= square_bb(r, f);
+      }
+    }
+  }
+
+  init_sliders(false, &rook_magics, &rook_table);
+  init_sliders(true, &bishop_magics, &bishop_table);
+}
+
+void AttackTables::init_sliders(bool diagonal, std::array<Magic, 64> *magics,
+                                std::vector<Bitboard> *table) {
+  const int(&directions)[4][2] = diagonal ? kBishopDirections : kRookDirections;
+
+  // Size the shared table up front so the per-square pointers stay valid.
+  std::array<size_t, 64> offsets;
+  size_t size = 0;
+  for (int square = 0; square < 64; square++) {
+    Magic &m = (*magics)[square];
+    m.mask = relevant_mask(square, directions);
+    m.shift = 64 - popcount(m.mask);
+    offsets[square] = size;
+    size += size_t{1} << popcount(m.mask);
+  }
+  table->assign(size, 0);
+
+  std::vector<Bitboard> occupancies, references;
+#if !defined(__BMI2__)
+  // The attempt that last wrote each table slot, so slots don't need clearing
+  // between attempts.
+  std::vector<int> epoch(4096, 0);
+  int attempt = 0;
+#endif
+  for (int square = 0; square < 64; square++) {
+    Magic &m = (*magics)[square];
+    Bitboard *attacks = table->data() + offsets[square];
+    m.attacks = attacks;
+    m.magic = 0;
+
+    // Enumerate every subset of the mask (Carry-Rippler).
+    occupancies.clear();
+    references.clear();
+    Bitboard subset = 0;
+    do {
+      occupancies.push_back(subset);
+      references.push_back(slide(square, directions, subset));
+      subset = (subset - m.mask) & m.mask;
+    } while (subset);
+
+#if defined(__BMI2__)
+    for (size_t i = 0; i < occupancies.size(); i++) {
+      attacks[_pext_u64(occupancies[i], m.mask)] = references[i];
+    }
+#else
+    MagicRng rng(kMagicSeeds[square / 8]);
+    bool found = false;
+    while (!found) {
+      do {
+        m.magic = rng.sparse();
+      } while (popcount((m.mask * m.magic) >> 56) < 6);
+
+      attempt++;
+      found = true;
+      for (size_t i = 0; i < occupancies.size(); i++) {
+        size_t index = (occupancies[i] * m.magic) >> m.shift;
+        if (epoch[index] < attempt) {
+          epoch[index] = attempt;
+          attacks[index] = references[i];
+        } else if (attacks[index] != references[i]) {
+          found = false;
+          break;
+        }
+      }
+    }
+#endif
+  }
+}
+
+}  // namespace chess
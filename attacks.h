@@ -0,0 +1,78 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+#include "bitboard.h"
+
+namespace chess {
+
+// Precomputed attack sets for every piece that doesn't depend on color.
+//
+// Sliding lookups use magic bitboards, or PEXT when compiled with BMI2
+// (`--config=bmi2`). In reconnaissance chess a slide is only stopped early by
+// the mover's own pieces, so callers pass whichever blockers they care about
+// rather than full occupancy. The returned set includes the first blocker on
+// each ray.
+class AttackTables {
+ public:
+  // Built once, on first use. Thread-safe.
+  static const AttackTables &get() {
+    static const AttackTables tables;
+    return tables;
+  }
+
+  Bitboard rook(int square, Bitboard blockers) const {
+    return rook_magics[square].lookup(blockers);
+  }
+  Bitboard bishop(int square, Bitboard blockers) const {
+    return bishop_magics[square].lookup(blockers);
+  }
+  Bitboard queen(int square, Bitboard blockers) const {
+    return rook(square, blockers) | bishop(square, blockers);
+  }
+  Bitboard knight(int square) const { return knight_attacks[square]; }
+  Bitboard king(int square) const { return king_attacks[square]; }
+
+  // The squares strictly between `from` and `to` if they share a rank, file
+  // or diagonal, otherwise empty.
+  Bitboard between(int from, int to) const { return between_squares[from][to]; }
+
+ private:
+  AttackTables();
+
+  struct Magic {
+    // Relevant blocker squares: the rays from the square, minus the last
+    // square of each ray.
+    Bitboard mask;
+    Bitboard magic;
+    const Bitboard *attacks;
+    int shift;
+
+    Bitboard lookup(Bitboard blockers) const {
+#if defined(__BMI2__)
+      return attacks[_pext_u64(blockers, mask)];
+#else
+      return attacks[((blockers & mask) * magic) >> shift];
+#endif
+    }
+  };
+
+  AttackTables(const AttackTables &) = delete;
+  AttackTables &operator=(const AttackTables &) = delete;
+
+  // Fill `magics` and `table` for rooks, or for bishops if `diagonal`.
+  void init_sliders(bool diagonal, std::array<Magic, 64> *magics,
+                    std::vector<Bitboard> *table);
+
+  std::array<Magic, 64> rook_magics, bishop_magics;
+  std::vector<Bitboard> rook_table, bishop_table;
+  std::array<Bitboard, 64> knight_attacks, king_attacks;
+  std::array<std::array<Bitboard, 64>, 64> between_squares;
+};
+
+}  // namespace chess
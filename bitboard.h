@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+
+namespace chess {
+
+// A set of squares, one bit per square. Squares are indexed rank * 8 + file,
+// so bit 0 is (0, 0) and bit 63 is (7, 7).
+using Bitboard = uint64_t;
+
+// Squares whose rank + file is even, i.e. the same color as (0, 0).
+constexpr Bitboard kEvenSquares = 0xAA55AA55AA55AA55ULL;
+
+constexpr int square_index(int rank, int file) { return rank * 8 + file; }
+
+constexpr Bitboard square_bb(int square) { return Bitboard{1} << square; }
+
+constexpr Bitboard square_bb(int rank, int file) {
+  return square_bb(square_index(rank, file));
+}
+
+inline int popcount(Bitboard b) { return __builtin_popcountll(b); }
+
+// Index of the lowest set square. `b` must be non-empty.
+inline int lsb(Bitboard b) { return __builtin_ctzll(b); }
+
+// Index of the highest set square. `b` must be non-empty.
+inline int msb(Bitboard b) { return 63 - __builtin_clzll(b); }
+
+// Remove the lowest set square from `b` and return its index.
+inline int pop_lsb(Bitboard &b) {
+  int square = lsb(b);
+  b &= b - 1;
+  return square;
+}
+
+}  // namespace chess
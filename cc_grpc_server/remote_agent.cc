@@ -1,4 +1,3 @@
-#include <iostream>
 #include <memory>
 #include <string>
 
@@ -6,6 +5,7 @@
 
 #include "chess.h"
 #include "chess_agent.h"
+#include "logging.h"
 #include "server_agent/agent.grpc.pb.h"
 
 using grpc::Server;
@@ -93,7 +93,7 @@ class ChessAgentImpl final : public RemoteAgent::Service {
   Status HandleGameStart(ServerContext *context,
                          const HandleGameStartRequest *request,
                          google::protobuf::Empty *reply) override {
-    ::std::cout << "Handling game start" << std::endl;
+    CHESS_LOG(VERBOSE) << "Handling game start";
     agent_.reset(new chess::agent::ChessAgent());
     agent_->handle_game_start(ProtobufColorToChess(request->color()));
 
@@ -103,7 +103,7 @@ class ChessAgentImpl final : public RemoteAgent::Service {
   Status HandleOpponentMove(ServerContext *context,
                             const HandleOpponentMoveRequest *request,
                             google::protobuf::Empty *reply) override {
-    ::std::cout << "Handling opponent move" << std::endl;
+    CHESS_LOG(VERBOSE) << "Handling opponent move";
     chess::Position captured_position =
         request->has_captured_square()
             ? ProtobufPositionToChess(request->captured_square())
@@ -116,7 +116,7 @@ class ChessAgentImpl final : public RemoteAgent::Service {
 
   Status ChooseSense(ServerContext *context, const ChooseSenseRequest *request,
                      ChooseSenseReply *reply) override {
-    ::std::cout << "Handling choose sense" << std::endl;
+    CHESS_LOG(VERBOSE) << "Handling choose sense";
     ::std::vector<chess::Position> possible_sense(
         request->possible_sense_size());
     ::std::vector<chess::Move> possible_moves(request->possible_moves_size());
@@ -135,7 +135,7 @@ class ChessAgentImpl final : public RemoteAgent::Service {
     auto sense_location = agent_->choose_sense(possible_sense, possible_moves,
                                                request->seconds_left());
 
-    std::cout << "Sensing: " << sense_location << std::endl;
+    CHESS_LOG(INFO) << "Sensing: " << sense_location;
 
     ChessPositionToProtobuf(sense_location, reply->mutable_sense_location());
 
@@ -145,11 +145,10 @@ class ChessAgentImpl final : public RemoteAgent::Service {
   Status HandleSenseResult(ServerContext *context,
                            const HandleSenseResultRequest *request,
                            google::protobuf::Empty *reply) override {
-    ::std::cout << "Handling sense result" << std::endl;
+    CHESS_LOG(VERBOSE) << "Handling sense result";
 
     ::std::vector<agent::SenseResult> raw_obs(request->result().begin(),
                                               request->result().end());
-    ::std::cout << std::endl;
     std::sort(
         raw_obs.begin(), raw_obs.end(),
         [](const agent::SenseResult &first, const agent::SenseResult &second) {
@@ -176,14 +175,14 @@ class ChessAgentImpl final : public RemoteAgent::Service {
 
     agent_->handle_sense_result(obs);
 
-    std::cout << "Finished handle sense result" << std::endl;
+    CHESS_LOG(VERBOSE) << "Finished handle sense result";
 
     return Status::OK;
   }
 
   Status ChooseMove(ServerContext *context, const ChooseMoveRequest *request,
                     ChooseMoveReply *reply) {
-    ::std::cout << "Handling choose move" << std::endl;
+    CHESS_LOG(VERBOSE) << "Handling choose move";
     chess::Move move = agent_->choose_move(request->seconds_left());
 
     ChessMoveToProtobuf(move, reply->mutable_move());
@@ -213,7 +212,7 @@ class ChessAgentImpl final : public RemoteAgent::Service {
   Status HandleGameEnd(ServerContext *context,
                        const HandleGameEndRequest *request,
                        google::protobuf::Empty *reply) {
-    ::std::cout << "Handling game end" << std::endl;
+    CHESS_LOG(VERBOSE) << "Handling game end";
     agent_->handle_game_end(ProtobufColorToChess(request->winner_color()),
                             request->win_reason());
     agent_.reset(new chess::agent::ChessAgent());
@@ -236,7 +235,7 @@ void RunServer() {
 
   std::unique_ptr<Server> server(builder.BuildAndStart());
 
-  std::cout << "Listening on " << server_address << std::endl;
+  CHESS_LOG(INFO) << "Listening on " << server_address;
 
   server->Wait();
 }
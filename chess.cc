@@ -1,6 +1,8 @@
 #include "chess.h"
 #include <cassert>
 #include <iostream>
+#include "attacks.h"
+#include "logging.h"
 #include "util.h"
 
 namespace chess {
@@ -22,79 +24,286 @@ int mirrored_rank(Color color, int rank) {
   }
 }
 
-void add_move(int r, int f, int nr, int nf, std::vector<Move> *moves,
-              int tr = -1, int tf = -1) {
-  if (nr < 0 || nr >= 8 || nf < 0 || nf >= 8) {
-    return;
+// What `piece` on rank `rank` adds to Board::score(Color::WHITE).
+int piece_score(Piece piece, int rank) {
+  int value = piece_value(piece.type) + mirrored_rank(piece.color, rank);
+  return piece.color == Color::WHITE ? value : -value;
+}
+
+// Random keys for Zobrist hashing. Seeded, so hashes match across runs.
+// An empty board with no castling rights or en passant target hashes to 0.
+class ZobristKeys {
+ public:
+  static const ZobristKeys &get() {
+    static const ZobristKeys keys;
+    return keys;
   }
-  if (tr == -1 && tf == -1) {
-    tr = nr;
-    tf = nf;
+
+  uint64_t piece(Piece piece, int square) const {
+    int index = (piece.color == Color::WHITE ? 0 : 6) +
+                static_cast<int>(piece.type) - 1;
+    return pieces[index][square];
+  }
+  uint64_t castling(uint8_t rights) const { return castling_rights[rights]; }
+  uint64_t en_passant(Position target) const {
+    if (target == Position::NONE) {
+      return 0;
+    }
+    return en_passant_targets[square_index(target.rank, target.file)];
+  }
+
+ private:
+  ZobristKeys() {
+    // splitmix64
+    uint64_t state = 0x5EED;
+    auto next = [&state]() {
+      uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      return z ^ (z >> 31);
+    };
+    for (auto &keys : pieces) {
+      for (uint64_t &key : keys) {
+        key = next();
+      }
+    }
+    castling_rights[0] = 0;
+    for (int i = 1; i < 16; i++) {
+      castling_rights[i] = next();
+    }
+    for (uint64_t &key : en_passant_targets) {
+      key = next();
+    }
   }
-  moves->push_back(Move{Position{r, f}, Position{nr, nf}});
-}
 
-}  // namespace
+  std::array<std::array<uint64_t, 64>, 12> pieces;
+  std::array<uint64_t, 16> castling_rights;
+  std::array<uint64_t, 64> en_passant_targets;
+};
 
-Board::Board() {
-  for (std::array<Piece, 8> &row : board) {
-    row.fill(Piece::EMPTY);
+// Add a move from (r, f) to every square in `targets`.
+void add_moves(int r, int f, Bitboard targets, MoveList *moves) {
+  while (targets) {
+    int square = pop_lsb(targets);
+    moves->push_back(Move{Position{r, f}, Position{square / 8, square % 8}});
   }
 }
 
-Board::Board(const std::array<std::array<Piece, 8>, 8> &board) : board(board) {}
+// The positions of every square in `squares`, in rank-major order.
+std::vector<Position> bitboard_positions(Bitboard squares) {
+  std::vector<Position> positions;
+  positions.reserve(popcount(squares));
+  while (squares) {
+    int square = pop_lsb(squares);
+    positions.emplace_back(square / 8, square % 8);
+  }
+  return positions;
+}
 
-std::vector<Move> Board::generate_moves(Color turn) const {
-  std::vector<Move> result;
+}  // namespace
+
+Board::Board() {}
+
+Board::Board(const std::array<std::array<Piece, 8>, 8> &board) {
   for (int i = 0; i < 8; i++) {
     for (int j = 0; j < 8; j++) {
-      if (occupation(i, j) == turn) {
-        collect_moves_for_piece(i, j, &result);
-      }
+      set_piece(i, j, board[i][j]);
     }
   }
-  return result;
+}
+
+std::vector<Move> Board::generate_moves(Color turn) const {
+  MoveList moves;
+  generate_moves(turn, moves);
+  return std::vector<Move>(moves.begin(), moves.end());
+}
+
+void Board::generate_moves(Color turn, MoveList &moves) const {
+  moves.clear();
+  Bitboard own = occupancy(turn);
+  while (own) {
+    int square = pop_lsb(own);
+    collect_moves_for_piece(square / 8, square % 8, &moves);
+  }
 }
 
 Piece Board::get_piece(int i, int j) const {
   assert(0 <= i && i < 8);
   assert(0 <= j && j < 8);
-  return board[i][j];
+  Bitboard bit = square_bb(i, j);
+  Piece piece = Piece::EMPTY;
+  if (by_color[0] & bit) {
+    piece.color = Color::WHITE;
+  } else if (by_color[1] & bit) {
+    piece.color = Color::BLACK;
+  } else {
+    return piece;
+  }
+
+  piece.type = PieceType::KING;
+  for (PieceType type : {PieceType::PAWN, PieceType::QUEEN, PieceType::ROOK,
+                         PieceType::KNIGHT, PieceType::BISHOP}) {
+    if (by_type[type_slot(type)] & bit) {
+      piece.type = type;
+      break;
+    }
+  }
+  return piece;
 }
 
 void Board::set_piece(int i, int j, Piece piece) {
   assert(0 <= i && i < 8);
   assert(0 <= j && j < 8);
-  board[i][j] = piece;
+  Bitboard bit = square_bb(i, j);
+  const ZobristKeys &keys = ZobristKeys::get();
+  if (occupied() & bit) {
+    Piece old = get_piece(i, j);
+    zobrist_hash ^= keys.piece(old, square_index(i, j));
+    white_score -= piece_score(old, i);
+  }
+  for (Bitboard &b : by_type) {
+    b &= ~bit;
+  }
+  by_color[0] &= ~bit;
+  by_color[1] &= ~bit;
+
+  if (piece.color == Color::EMPTY || piece.type == PieceType::EMPTY) {
+    return;
+  }
+  by_color[piece.color == Color::WHITE ? 0 : 1] |= bit;
+  if (piece.type != PieceType::KING) {
+    by_type[type_slot(piece.type)] |= bit;
+  }
+  zobrist_hash ^= keys.piece(piece, square_index(i, j));
+  white_score += piece_score(piece, i);
+}
+
+uint64_t Board::compute_hash() const {
+  const ZobristKeys &keys = ZobristKeys::get();
+  uint64_t result =
+      keys.castling(castling_rights) ^ keys.en_passant(en_passant_target);
+  Bitboard squares = occupied();
+  while (squares) {
+    int square = pop_lsb(squares);
+    result ^= keys.piece(get_piece(square / 8, square % 8), square);
+  }
+  return result;
+}
+
+int Board::compute_score() const {
+  int result = 0;
+  Bitboard squares = occupied();
+  while (squares) {
+    int square = pop_lsb(squares);
+    result += piece_score(get_piece(square / 8, square % 8), square / 8);
+  }
+  return result;
+}
+
+int piece_value(PieceType piece) {
+  switch (piece) {
+    case PieceType::PAWN:
+      return 1;
+    case PieceType::KING:
+      return 100;
+    case PieceType::QUEEN:
+      return 20;
+    case PieceType::KNIGHT:
+      return 10;
+    case PieceType::ROOK:
+      return 10;
+    case PieceType::BISHOP:
+      return 10;
+    default:
+      return 0;
+  }
+}
+
+void BoardColumns::reserve(size_t n) {
+  for (auto &column : types) {
+    column.reserve(n);
+  }
+  for (auto &column : colors) {
+    column.reserve(n);
+  }
+  hashes.reserve(n);
+  scores.reserve(n);
+  castling_rights.reserve(n);
+  en_passant_targets.reserve(n);
+}
+
+void BoardColumns::push_back(const Board &board) {
+  for (size_t t = 0; t < types.size(); t++) {
+    types[t].push_back(board.by_type[t]);
+  }
+  for (size_t c = 0; c < colors.size(); c++) {
+    colors[c].push_back(board.by_color[c]);
+  }
+  hashes.push_back(board.zobrist_hash);
+  scores.push_back(board.white_score);
+  castling_rights.push_back(board.castling_rights);
+  en_passant_targets.push_back(board.en_passant_target);
+}
+
+Board BoardColumns::get(size_t i) const {
+  Board board;
+  for (size_t t = 0; t < types.size(); t++) {
+    board.by_type[t] = types[t][i];
+  }
+  for (size_t c = 0; c < colors.size(); c++) {
+    board.by_color[c] = colors[c][i];
+  }
+  board.zobrist_hash = hashes[i];
+  board.white_score = scores[i];
+  board.castling_rights = castling_rights[i];
+  board.en_passant_target = en_passant_targets[i];
+  return board;
+}
+
+void Board::allow_castling(Color color) {
+  const ZobristKeys &keys = ZobristKeys::get();
+  zobrist_hash ^= keys.castling(castling_rights);
+  castling_rights |= kingside_right(color) | queenside_right(color);
+  zobrist_hash ^= keys.castling(castling_rights);
+}
+
+void Board::remove_castling_rights(uint8_t rights) {
+  const ZobristKeys &keys = ZobristKeys::get();
+  zobrist_hash ^= keys.castling(castling_rights);
+  castling_rights &= ~rights;
+  zobrist_hash ^= keys.castling(castling_rights);
+}
+
+void Board::set_en_passant_target(Position target) {
+  const ZobristKeys &keys = ZobristKeys::get();
+  zobrist_hash ^= keys.en_passant(en_passant_target);
+  en_passant_target = target;
+  zobrist_hash ^= keys.en_passant(en_passant_target);
 }
 
 std::vector<Position> Board::find_all_valid_color(Color color,
                                                   Position position) const {
-  std::vector<Position> positions;
-  for (int i = 0; i < 8; ++i) {
-    for (int j = 0; j < 8; ++j) {
-      if (get_piece(i, j).color == color &&
-          get_piece(i, j).type != PieceType::KING &&
-          (get_piece(i, j).type != PieceType::BISHOP ||
-           (i + j) % 2 != (position.rank + position.file) % 2))
-        positions.emplace_back(i, j);
-    }
+  // Bishops can't reach squares of the same parity as `position`.
+  int parity = (position.rank + position.file) % 2;
+  Bitboard excluded_bishops = 0;
+  if (parity == 0) {
+    excluded_bishops = pieces(PieceType::BISHOP) & kEvenSquares;
+  } else if (parity == 1) {
+    excluded_bishops = pieces(PieceType::BISHOP) & ~kEvenSquares;
   }
 
-  return positions;
+  return bitboard_positions(occupancy(color) & ~pieces(PieceType::KING) &
+                            ~excluded_bishops);
 }
 
 std::vector<Position> Board::find_all_piece(Piece piece) const {
-  std::vector<Position> positions;
-  for (int i = 0; i < 8; ++i) {
-    for (int j = 0; j < 8; ++j) {
-      if (get_piece(i, j) == piece) {
-        positions.emplace_back(i, j);
-      }
+  if (piece.color == Color::EMPTY || piece.type == PieceType::EMPTY) {
+    if (piece != Piece::EMPTY) {
+      return {};
     }
+    return bitboard_positions(~occupied());
   }
-
-  return positions;
+  return bitboard_positions(pieces(piece.color, piece.type));
 }
 
 Board Board::initial_board() {
@@ -144,19 +353,17 @@ Board Board::initial_board() {
   result.set_piece(1, 6, Piece{Color::WHITE, PieceType::PAWN});
   result.set_piece(1, 7, Piece{Color::WHITE, PieceType::PAWN});
 
-  result.can_castle_kingside_white = false;
-  result.can_castle_queenside_white = false;
-  result.can_castle_kingside_black = false;
-  result.can_castle_queenside_black = false;
+  result.remove_castling_rights(kWhiteKingside | kWhiteQueenside |
+                                kBlackKingside | kBlackQueenside);
 
   return result;
 }
 
 void Board::debug_print(std::ostream &out) const {
-  std::cout << can_castle_kingside_white << " " << can_castle_queenside_white
-            << std::endl;
-  std::cout << can_castle_kingside_black << " " << can_castle_queenside_black
-            << std::endl;
+  out << get_castle_kingside_white() << " " << get_castle_queenside_white()
+      << '\n';
+  out << get_castle_kingside_black() << " " << get_castle_queenside_black()
+      << '\n';
   for (int i = 0; i < 8; i++) {
     for (int j = 0; j < 8; j++) {
       out.put(get_piece(i, j).get_symbol());
@@ -170,7 +377,8 @@ void Board::debug_print(std::ostream &out) const {
 
 MoveResult Board::apply_move(Move move) {
   if (move.from == move.to) {
-    std::cout << "Move failed " << move << std::endl;
+    CHESS_LOG(ERROR) << "Move failed " << move;
+    Logger::global().flush();
     assert(false);
   }
   switch (get_piece(move.from.rank, move.from.file).type) {
@@ -202,8 +410,8 @@ MoveResult Board::apply_move_pawn(Move move) {
     auto result = apply_move_linear(move.from, move.to, false);
     if (mirrored_to_rank == mirrored_from_rank + 2) {
       assert(mirrored_from_rank == 1);
-      en_passant_target = {mirrored_rank(color, mirrored_from_rank + 1),
-                           move.from.file};
+      set_en_passant_target(
+          {mirrored_rank(color, mirrored_from_rank + 1), move.from.file});
     }
     return result;
   } else {
@@ -222,13 +430,16 @@ MoveResult Board::apply_move_pawn(Move move) {
       assert(captured_target_rank);
       assert(0 <= captured_target_rank && captured_target_rank < 8);
       assert(0 <= captured_target_file && captured_target_file < 8);
-      std::swap(board[captured_target_rank][captured_target_file],
-                result.capture.piece);
+      result.capture.piece =
+          get_piece(captured_target_rank, captured_target_file);
+      set_piece(captured_target_rank, captured_target_file, Piece::EMPTY);
       result.capture.position = {captured_target_rank, captured_target_file};
       result.move = move;
       return result;
     } else {
-      // Wasted move
+      // Wasted move. It still takes a turn, so the chance to capture en
+      // passant is gone.
+      set_en_passant_target(Position::NONE);
       return MoveResult::WASTED;
     }
   }
@@ -243,53 +454,42 @@ MoveResult Board::apply_move_king(Move move) {
 
   int mirrored_from_rank = mirrored_rank(color, move.from.rank),
       mirrored_to_rank = mirrored_rank(color, move.to.rank);
-  bool &can_castle_kingside =
-      (color == Color::WHITE ? can_castle_kingside_white
-                             : can_castle_kingside_black);
-  bool &can_castle_queenside =
-      (color == Color::WHITE ? can_castle_queenside_white
-                             : can_castle_queenside_black);
   if (abs(move.from.file - move.to.file) > 1) {
     assert(mirrored_from_rank == mirrored_to_rank);
     assert(mirrored_from_rank == 0);
     assert(move.from.file == 4);
     if (move.from.file < move.to.file) {
       // Kingside
-      assert(can_castle_kingside);
+      assert(castling_rights & kingside_right(color));
       if (occupation(move.from.rank, 6) != Color::EMPTY ||
           occupation(move.from.rank, 5) != Color::EMPTY) {
-        // We can't take this move, so don't revoke castling ability.
+        // We can't take this move, so don't revoke castling ability. The
+        // turn is still used up, as is any chance to capture en passant.
+        set_en_passant_target(Position::NONE);
         return MoveResult::WASTED;
       }
       move_piece(move.from, move.to);
       move_piece({move.from.rank, 7}, {move.to.rank, 5});
     } else {
       // Queenside
-      assert(can_castle_queenside);
+      assert(castling_rights & queenside_right(color));
       if (occupation(move.from.rank, 1) != Color::EMPTY ||
           occupation(move.from.rank, 2) != Color::EMPTY ||
           occupation(move.from.rank, 3) != Color::EMPTY) {
         // Same situation as above: no move taken
+        set_en_passant_target(Position::NONE);
         return MoveResult::WASTED;
       }
       move_piece(move.from, move.to);
       move_piece({move.from.rank, 0}, {move.to.rank, 3});
     }
-    if (color == Color::WHITE) {
-      can_castle_kingside_white = can_castle_queenside_white = false;
-    } else {
-      can_castle_kingside_black = can_castle_queenside_black = false;
-    }
+    remove_castling_rights(kingside_right(color) | queenside_right(color));
     return {move, Capture::NONE};
   } else {
     assert(std::max(abs(move.to.rank - move.from.rank),
                     abs(move.to.file - move.from.file)) == 1);
     assert(occupation(move.to.rank, move.to.file) != color);
-    if (color == Color::WHITE) {
-      can_castle_kingside_white = can_castle_queenside_white = false;
-    } else {
-      can_castle_kingside_black = can_castle_queenside_black = false;
-    }
+    remove_castling_rights(kingside_right(color) | queenside_right(color));
     return move_piece(move.from, move.to);
   }
 }
@@ -301,24 +501,10 @@ MoveResult Board::apply_move_rook(Move move) {
   assert((move.to.rank - move.from.rank) == 0 ||
          (move.to.file - move.from.file) == 0);
   int mirrored_from_rank = mirrored_rank(color, move.from.rank);
-  bool &can_castle_kingside =
-      (color == Color::WHITE ? can_castle_kingside_white
-                             : can_castle_kingside_black);
-  bool &can_castle_queenside =
-      (color == Color::WHITE ? can_castle_queenside_white
-                             : can_castle_queenside_black);
   if (move.from.file == 7 && mirrored_from_rank == 0) {
-    if (color == Color::WHITE) {
-      can_castle_kingside_white = false;
-    } else {
-      can_castle_kingside_black = false;
-    }
+    remove_castling_rights(kingside_right(color));
   } else if (move.from.file == 0 && mirrored_from_rank == 0) {
-    if (color == Color::WHITE) {
-      can_castle_queenside_white = false;
-    } else {
-      can_castle_queenside_black = false;
-    }
+    remove_castling_rights(queenside_right(color));
   }
   return apply_move_linear(move.from, move.to, true);
 }
@@ -350,28 +536,33 @@ MoveResult Board::apply_move_linear(Position from, Position to,
   int dfile = three_way_compare(to.file, from.file);
   assert((to.rank - from.rank) * dfile == (to.file - from.file) * drank);
 
-  int rank = from.rank, file = from.file;
-  while (rank != to.rank || file != to.file) {
-    if (occupation(rank + drank, file + dfile) == color) {
-      break;
-    } else if (occupation(rank + drank, file + dfile) == opponent(color)) {
-      if (allow_capture) {
-        rank += drank;
-        file += dfile;
-      }
-      break;
-    }
-    rank += drank;
-    file += dfile;
+  int from_square = square_index(from.rank, from.file);
+  int to_square = square_index(to.rank, to.file);
+  Bitboard path = AttackTables::get().between(from_square, to_square) |
+                  square_bb(to_square);
+  Bitboard blockers = path & occupied();
+  if (!blockers) {
+    return move_piece(from, to);
   }
-  return move_piece(from, Position{rank, file});
+
+  // Stop at the first piece along the path, or just short of it.
+  int step = drank * 8 + dfile;
+  int stop = step > 0 ? lsb(blockers) : msb(blockers);
+  if (!allow_capture || (occupancy(color) & square_bb(stop))) {
+    stop -= step;
+  }
+  return move_piece(from, Position{stop / 8, stop % 8});
 }
 
 MoveResult Board::move_piece(Position from, Position to) {
-  Piece captured = Piece::EMPTY;
-  std::swap(board[to.rank][to.file], board[from.rank][from.file]);
-  std::swap(board[from.rank][from.file], captured);
-  en_passant_target = {-1, -1};
+  set_en_passant_target(Position::NONE);
+  if (from == to) {
+    // A slide blocked on its first square leaves the piece where it was.
+    return {{from, to}, Capture::NONE};
+  }
+  Piece captured = get_piece(to.rank, to.file);
+  set_piece(to.rank, to.file, get_piece(from.rank, from.file));
+  set_piece(from.rank, from.file, Piece::EMPTY);
   if (captured != Piece::EMPTY) {
     return {{from, to}, Capture{captured, to}};
   } else {
@@ -380,28 +571,26 @@ MoveResult Board::move_piece(Position from, Position to) {
 }
 
 void Board::collect_moves_for_piece(int rank, int file,
-                                    std::vector<Move> *moves) const {
+                                    MoveList *moves) const {
+  add_moves(rank, file, targets_for_piece(rank, file), moves);
+}
+
+Bitboard Board::targets_for_piece(int rank, int file) const {
   switch (get_piece(rank, file).type) {
     case PieceType::PAWN:
-      collect_moves_for_pawn(rank, file, moves);
-      break;
+      return targets_for_pawn(rank, file);
     case PieceType::QUEEN:
-      collect_moves_for_queen(rank, file, moves);
-      break;
+      return targets_for_queen(rank, file);
     case PieceType::KING:
-      collect_moves_for_king(rank, file, moves);
-      break;
+      return targets_for_king(rank, file);
     case PieceType::ROOK:
-      collect_moves_for_rook(rank, file, moves);
-      break;
+      return targets_for_rook(rank, file);
     case PieceType::KNIGHT:
-      collect_moves_for_knight(rank, file, moves);
-      break;
+      return targets_for_knight(rank, file);
     case PieceType::BISHOP:
-      collect_moves_for_bishop(rank, file, moves);
-      break;
+      return targets_for_bishop(rank, file);
     default:
-      break;
+      return 0;
   }
 }
 
@@ -409,166 +598,151 @@ Color Board::occupation(int i, int j) const {
   if (i < 0 || 8 <= i || j < 0 || 8 <= j) {
     return Color::EMPTY;
   }
-  return get_piece(i, j).color;
+  Bitboard bit = square_bb(i, j);
+  if (by_color[0] & bit) {
+    return Color::WHITE;
+  } else if (by_color[1] & bit) {
+    return Color::BLACK;
+  }
+  return Color::EMPTY;
 }
 
-void Board::collect_moves_for_pawn(int rank, int file,
-                                   std::vector<Move> *moves) const {
-  Piece piece = get_piece(rank, file);
-  Color color = piece.color;
+Bitboard Board::targets_for_pawn(int rank, int file) const {
+  Color color = occupation(rank, file);
 
-  int8_t direction = (color == Color::BLACK) ? -1 : 1;
-  if (occupation(rank + direction, file) == Color::EMPTY) {
-    add_move(rank, file, rank + direction, file, moves);
+  int direction = (color == Color::BLACK) ? -1 : 1;
+  int next_rank = rank + direction;
+  if (next_rank < 0 || next_rank >= 8) {
+    return 0;
+  }
+
+  Bitboard targets = 0;
+  if (occupation(next_rank, file) == Color::EMPTY) {
+    targets |= square_bb(next_rank, file);
 
     if (((color == Color::BLACK && rank == 6) ||
          (color == Color::WHITE && rank == 1)) &&
-        occupation(rank + direction * 2, file) == Color::EMPTY) {
-      add_move(rank, file, rank + direction * 2, file, moves);
+        occupation(next_rank + direction, file) == Color::EMPTY) {
+      targets |= square_bb(next_rank + direction, file);
     }
   }
 
-  if (occupation(rank + direction, file + 1) != color) {
-    add_move(rank, file, rank + direction, file + 1, moves);
+  // Diagonal moves are allowed onto empty squares; they're wasted if nothing
+  // is there to capture.
+  Bitboard own = occupancy(color);
+  if (file + 1 < 8) {
+    targets |= square_bb(next_rank, file + 1) & ~own;
   }
-  if (occupation(rank + direction, file - 1) != color) {
-    add_move(rank, file, rank + direction, file - 1, moves);
+  if (file - 1 >= 0) {
+    targets |= square_bb(next_rank, file - 1) & ~own;
   }
+  return targets;
 }
 
-void Board::collect_moves_for_queen(int rank, int file,
-                                    std::vector<Move> *moves) const {
-  Piece piece = get_piece(rank, file);
-  Color color = piece.color;
-
-  collect_moves_linear(rank, file, 1, 0, color, moves);
-  collect_moves_linear(rank, file, -1, 0, color, moves);
-  collect_moves_linear(rank, file, 0, 1, color, moves);
-  collect_moves_linear(rank, file, 0, -1, color, moves);
-  collect_moves_linear(rank, file, 1, 1, color, moves);
-  collect_moves_linear(rank, file, 1, -1, color, moves);
-  collect_moves_linear(rank, file, -1, 1, color, moves);
-  collect_moves_linear(rank, file, -1, -1, color, moves);
+Bitboard Board::targets_for_queen(int rank, int file) const {
+  Bitboard own = occupancy(occupation(rank, file));
+  return AttackTables::get().queen(square_index(rank, file), own) & ~own;
 }
 
-void Board::collect_moves_for_king(int rank, int file,
-                                   std::vector<Move> *moves) const {
-  Piece piece = get_piece(rank, file);
-  Color color = piece.color;
+Bitboard Board::targets_for_king(int rank, int file) const {
+  Color color = occupation(rank, file);
 
-  collect_moves_linear(rank, file, 1, 0, color, moves, 1);
-  collect_moves_linear(rank, file, -1, 0, color, moves, 1);
-  collect_moves_linear(rank, file, 0, 1, color, moves, 1);
-  collect_moves_linear(rank, file, 0, -1, color, moves, 1);
-  collect_moves_linear(rank, file, 1, 1, color, moves, 1);
-  collect_moves_linear(rank, file, 1, -1, color, moves, 1);
-  collect_moves_linear(rank, file, -1, 1, color, moves, 1);
-  collect_moves_linear(rank, file, -1, -1, color, moves, 1);
-
-  bool can_castle_kingside =
-      (color == Color::WHITE ? can_castle_kingside_white
-                             : can_castle_kingside_black);
-  bool can_castle_queenside =
-      (color == Color::WHITE ? can_castle_queenside_white
-                             : can_castle_queenside_black);
+  Bitboard own = occupancy(color);
+  Bitboard targets = AttackTables::get().king(square_index(rank, file)) & ~own;
+
+  bool can_castle_kingside = castling_rights & kingside_right(color);
+  bool can_castle_queenside = castling_rights & queenside_right(color);
 
   // Castling
   if (can_castle_kingside && occupation(rank, 5) == Color::EMPTY &&
       occupation(rank, 6) == Color::EMPTY) {
-    add_move(rank, file, rank, 6, moves);
+    targets |= square_bb(rank, 6);
   }
   if (can_castle_queenside && occupation(rank, 2) == Color::EMPTY &&
       occupation(rank, 3) == Color::EMPTY) {
-    add_move(rank, file, rank, 2, moves);
+    targets |= square_bb(rank, 2);
   }
+  return targets;
 }
 
-void Board::collect_moves_for_rook(int rank, int file,
-                                   std::vector<Move> *moves) const {
-  Piece piece = get_piece(rank, file);
-  Color color = piece.color;
-
-  collect_moves_linear(rank, file, 1, 0, color, moves);
-  collect_moves_linear(rank, file, -1, 0, color, moves);
-  collect_moves_linear(rank, file, 0, 1, color, moves);
-  collect_moves_linear(rank, file, 0, -1, color, moves);
+Bitboard Board::targets_for_rook(int rank, int file) const {
+  Bitboard own = occupancy(occupation(rank, file));
+  return AttackTables::get().rook(square_index(rank, file), own) & ~own;
 }
 
-void Board::collect_moves_for_knight(int rank, int file,
-                                     std::vector<Move> *moves) const {
-  Piece piece = get_piece(rank, file);
-  Color color = piece.color;
-
-  if (occupation(rank + 2, file + 1) != color) {
-    add_move(rank, file, rank + 2, file + 1, moves);
-  }
-  if (occupation(rank + 2, file - 1) != color) {
-    add_move(rank, file, rank + 2, file - 1, moves);
-  }
-  if (occupation(rank - 2, file + 1) != color) {
-    add_move(rank, file, rank - 2, file + 1, moves);
-  }
-  if (occupation(rank - 2, file - 1) != color) {
-    add_move(rank, file, rank - 2, file - 1, moves);
-  }
-  if (occupation(rank + 1, file + 2) != color) {
-    add_move(rank, file, rank + 1, file + 2, moves);
-  }
-  if (occupation(rank + 1, file - 2) != color) {
-    add_move(rank, file, rank + 1, file - 2, moves);
-  }
-  if (occupation(rank - 1, file + 2) != color) {
-    add_move(rank, file, rank - 1, file + 2, moves);
-  }
-  if (occupation(rank - 1, file - 2) != color) {
-    add_move(rank, file, rank - 1, file - 2, moves);
-  }
+Bitboard Board::targets_for_knight(int rank, int file) const {
+  Bitboard own = occupancy(occupation(rank, file));
+  return AttackTables::get().knight(square_index(rank, file)) & ~own;
 }
 
-void Board::collect_moves_for_bishop(int rank, int file,
-                                     std::vector<Move> *moves) const {
-  Piece piece = get_piece(rank, file);
-  Color color = piece.color;
-
-  collect_moves_linear(rank, file, 1, 1, color, moves);
-  collect_moves_linear(rank, file, 1, -1, color, moves);
-  collect_moves_linear(rank, file, -1, 1, color, moves);
-  collect_moves_linear(rank, file, -1, -1, color, moves);
+Bitboard Board::targets_for_bishop(int rank, int file) const {
+  Bitboard own = occupancy(occupation(rank, file));
+  return AttackTables::get().bishop(square_index(rank, file), own) & ~own;
 }
 
-void Board::collect_moves_linear(int rank, int file, int dr, int df,
-                                 Color color, std::vector<Move> *moves,
-                                 int d) const {
-  for (int i = 1; i <= d; i++) {
-    if (occupation(rank + dr * i, file + df * i) != color) {
-      add_move(rank, file, rank + dr * i, file + df * i, moves);
-    } else {
-      break;
+MoveResult Board::do_random_move(Color color) {
+  // Count every move in one pass, then index into the piece that owns the
+  // chosen one.
+  int num_pieces = 0, num_moves = 0;
+  std::array<int, 64> squares, counts;
+  std::array<Bitboard, 64> targets;
+  Bitboard own = occupancy(color);
+  while (own) {
+    int square = pop_lsb(own);
+    Bitboard piece_targets = targets_for_piece(square / 8, square % 8);
+    if (piece_targets) {
+      squares[num_pieces] = square;
+      targets[num_pieces] = piece_targets;
+      counts[num_pieces] = popcount(piece_targets);
+      num_moves += counts[num_pieces];
+      num_pieces++;
     }
   }
+  if (num_moves == 0) {
+    return MoveResult::WASTED;
+  }
+
+  int choice = random_int(num_moves);
+  int i = 0;
+  while (choice >= counts[i]) {
+    choice -= counts[i++];
+  }
+  Bitboard remaining = targets[i];
+  for (; choice > 0; choice--) {
+    remaining &= remaining - 1;
+  }
+  int to = lsb(remaining);
+  return apply_move(Move{Position{squares[i] / 8, squares[i] % 8},
+                         Position{to / 8, to % 8}});
 }
 
-MoveResult Board::do_random_move(Color color) {
-  int num_pieces = 0;
-  std::array<Position, 16> positions;
-  for (int i = 0; i < 8; i++) {
-    for (int j = 0; j < 8; j++) {
-      if (occupation(i, j) == color) {
-        positions[num_pieces++] = {i, j};
+MoveResult Board::do_random_move(Color color, const MoveWeights &weights) {
+  // Weighted reservoir sampling: keep each move with probability
+  // weight / (total weight so far).
+  double total_weight = 0;
+  Move chosen{Position::NONE, Position::NONE};
+  Bitboard own = occupancy(color);
+  while (own) {
+    int square = pop_lsb(own);
+    Position from{square / 8, square % 8};
+    Bitboard piece_targets = targets_for_piece(from.rank, from.file);
+    while (piece_targets) {
+      int to = pop_lsb(piece_targets);
+      Move move{from, Position{to / 8, to % 8}};
+      double weight = weights(*this, move);
+      if (weight <= 0) {
+        continue;
+      }
+      total_weight += weight;
+      if (random_float(0, total_weight) < weight) {
+        chosen = move;
       }
     }
   }
-
-  while (true) {
-    Position piece_position = positions[random_int(num_pieces)];
-
-    // Calculate moves for position.
-    std::vector<Move> moves;
-    collect_moves_for_piece(piece_position.rank, piece_position.file, &moves);
-    if (moves.size()) {
-      return apply_move(random_choice(moves));
-    }
+  if (chosen.from == Position::NONE) {
+    return do_random_move(color);
   }
+  return apply_move(chosen);
 }
 
 char Piece::get_symbol() const {
@@ -1,9 +1,14 @@
 #pragma once
 
 #include <array>
+#include <cassert>
+#include <functional>
 #include <iostream>
+#include <new>
 #include <vector>
 
+#include "bitboard.h"
+
 namespace chess {
 
 enum class PieceType : uint8_t {
@@ -118,6 +123,11 @@ struct Capture {
 struct Move {
   Position from, to;
 
+  bool operator==(const Move &other) const {
+    return from == other.from && to == other.to;
+  }
+  bool operator!=(const Move &other) const { return !(*this == other); }
+
   bool operator<(const Move &other) const {
     if (from < other.from) {
       return true;
@@ -141,6 +151,42 @@ inline std::ostream &operator<<(std::ostream &out, Move m) {
   return out;
 }
 
+// A fixed-capacity list of moves that lives on the stack, so move generation
+// never touches the heap.
+class MoveList {
+ public:
+  // Comfortably above the moves any position reachable by Board generates.
+  static constexpr size_t kCapacity = 256;
+
+  void push_back(Move move) {
+    assert(count < kCapacity);
+    if (count < kCapacity) {
+      new (&data()[count++]) Move(move);
+    }
+  }
+  void clear() { count = 0; }
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  Move &operator[](size_t i) { return data()[i]; }
+  const Move &operator[](size_t i) const { return data()[i]; }
+
+  Move *begin() { return data(); }
+  Move *end() { return data() + count; }
+  const Move *begin() const { return data(); }
+  const Move *end() const { return data() + count; }
+
+ private:
+  Move *data() { return reinterpret_cast<Move *>(storage); }
+  const Move *data() const { return reinterpret_cast<const Move *>(storage); }
+
+  // Left uninitialized; Move's default constructor would otherwise write all
+  // of it on every construction.
+  alignas(Move) unsigned char storage[kCapacity * sizeof(Move)];
+  size_t count = 0;
+};
+
 inline Color opponent(Color a) {
   if (a == Color::WHITE) {
     return Color::BLACK;
@@ -149,11 +195,21 @@ inline Color opponent(Color a) {
   }
 }
 
+// Material value of a piece, for heuristics.
+int piece_value(PieceType piece);
+
+class Board;
+
+// Relative, non-negative weight of a move for Board::do_random_move.
+using MoveWeights = std::function<double(const Board &, Move)>;
+
 class Board {
  public:
   Board();
   explicit Board(const std::array<std::array<Piece, 8>, 8> &board);
   std::vector<Move> generate_moves(Color turn) const;
+  // Replace the contents of `moves` with every move for `turn`.
+  void generate_moves(Color turn, MoveList &moves) const;
 
   // Apply a move and return the captured piece, if any
   MoveResult apply_move(Move move);
@@ -168,32 +224,118 @@ class Board {
                                                Position position) const;
   ::std::vector<Position> find_all_piece(Piece piece) const;
 
+  // Apply a move drawn uniformly from all of `color`'s moves. Returns
+  // MoveResult::WASTED if there are none.
   MoveResult do_random_move(Color color);
+  // As above, but draw each move with probability proportional to
+  // `weights(*this, move)`. Falls back to uniform if every weight is zero.
+  MoveResult do_random_move(Color color, const MoveWeights &weights);
 
-  bool get_castle_kingside_white() const { return can_castle_kingside_white; }
-  bool get_castle_queenside_white() const { return can_castle_queenside_white; }
-  bool get_castle_kingside_black() const { return can_castle_kingside_black; }
-  bool get_castle_queenside_black() const { return can_castle_queenside_black; }
+  bool get_castle_kingside_white() const {
+    return castling_rights & kWhiteKingside;
+  }
+  bool get_castle_queenside_white() const {
+    return castling_rights & kWhiteQueenside;
+  }
+  bool get_castle_kingside_black() const {
+    return castling_rights & kBlackKingside;
+  }
+  bool get_castle_queenside_black() const {
+    return castling_rights & kBlackQueenside;
+  }
+  // Let `color` castle on both sides. initial_board() grants no rights.
+  void allow_castling(Color color);
   MoveResult move_piece(Position from, Position to);
 
+  // Bitboard queries. Color::EMPTY selects the empty squares.
+  Bitboard occupied() const { return by_color[0] | by_color[1]; }
+  Bitboard occupancy(Color color) const {
+    switch (color) {
+      case Color::WHITE:
+        return by_color[0];
+      case Color::BLACK:
+        return by_color[1];
+      default:
+        return ~occupied();
+    }
+  }
+  Bitboard pieces(PieceType type) const {
+    switch (type) {
+      case PieceType::EMPTY:
+        return ~occupied();
+      case PieceType::KING:
+        return occupied() & ~(by_type[0] | by_type[1] | by_type[2] |
+                              by_type[3] | by_type[4]);
+      default:
+        return by_type[type_slot(type)];
+    }
+  }
+  Bitboard pieces(Color color, PieceType type) const {
+    return occupancy(color) & pieces(type);
+  }
+
+  // Zobrist hash of the pieces, castling rights and en passant target, kept
+  // up to date by every change to the board.
+  uint64_t hash() const { return zobrist_hash; }
+  // Recompute hash() from scratch.
+  uint64_t compute_hash() const;
+
+  // Material and advancement from `color`'s side: piece_value plus the ranks
+  // moved up the board for each of its pieces, less the same for the
+  // opponent's. Kept up to date by every change to the board, like the hash.
+  int score(Color color) const {
+    return color == Color::BLACK ? -white_score : white_score;
+  }
+  // Recompute score(Color::WHITE) from scratch.
+  int compute_score() const;
+
+  bool operator==(const Board &other) const {
+    return zobrist_hash == other.zobrist_hash && by_type == other.by_type &&
+           by_color == other.by_color &&
+           castling_rights == other.castling_rights &&
+           en_passant_target == other.en_passant_target;
+  }
+  bool operator!=(const Board &other) const { return !((*this) == other); }
+
  private:
-  // Collect the valid moves for a given piece into the vector at `moves`.
-  void collect_moves_for_piece(int rank, int file,
-                               std::vector<Move> *moves) const;
-  void collect_moves_for_pawn(int rank, int file,
-                              std::vector<Move> *moves) const;
-  void collect_moves_for_queen(int rank, int file,
-                               std::vector<Move> *moves) const;
-  void collect_moves_for_king(int rank, int file,
-                              std::vector<Move> *moves) const;
-  void collect_moves_for_rook(int rank, int file,
-                              std::vector<Move> *moves) const;
-  void collect_moves_for_knight(int rank, int file,
-                                std::vector<Move> *moves) const;
-  void collect_moves_for_bishop(int rank, int file,
-                                std::vector<Move> *moves) const;
-  void collect_moves_linear(int rank, int file, int dr, int df, Color color,
-                            std::vector<Move> *moves, int d = 8) const;
+  enum CastlingRight : uint8_t {
+    kWhiteKingside = 1,
+    kWhiteQueenside = 2,
+    kBlackKingside = 4,
+    kBlackQueenside = 8,
+  };
+
+  static uint8_t kingside_right(Color color) {
+    return color == Color::WHITE ? kWhiteKingside : kBlackKingside;
+  }
+  static uint8_t queenside_right(Color color) {
+    return color == Color::WHITE ? kWhiteQueenside : kBlackQueenside;
+  }
+
+  // The only ways castling rights and the en passant target change, so the
+  // hash stays in sync.
+  void remove_castling_rights(uint8_t rights);
+  void set_en_passant_target(Position target);
+
+  // Index into `by_type` for every type except EMPTY and KING.
+  static int type_slot(PieceType type) {
+    int slot = static_cast<int>(type) - 1;
+    return slot > 2 ? slot - 1 : slot;
+  }
+
+  // Collect the valid moves for a given piece into the list at `moves`.
+  void collect_moves_for_piece(int rank, int file, MoveList *moves) const;
+
+  // The destination squares of every valid move for a given piece. Every
+  // move a piece has lands on a different square, so these are exactly its
+  // moves.
+  Bitboard targets_for_piece(int rank, int file) const;
+  Bitboard targets_for_pawn(int rank, int file) const;
+  Bitboard targets_for_queen(int rank, int file) const;
+  Bitboard targets_for_king(int rank, int file) const;
+  Bitboard targets_for_rook(int rank, int file) const;
+  Bitboard targets_for_knight(int rank, int file) const;
+  Bitboard targets_for_bishop(int rank, int file) const;
 
   // Apply a move for a specific piece type.
   MoveResult apply_move_pawn(Move move);
@@ -207,11 +349,62 @@ class Board {
 
   Color occupation(int i, int j) const;
 
-  std::array<std::array<Piece, 8>, 8> board;
+  // Pawns, queens, rooks, knights and bishops of both colors. Kings are not
+  // stored: they are the occupied squares no other type claims, which keeps
+  // Board small enough to copy into every particle.
+  std::array<Bitboard, 5> by_type{};
+  // White and black occupancy.
+  std::array<Bitboard, 2> by_color{};
+
+  uint64_t zobrist_hash = 0;
 
-  bool can_castle_kingside_white = false, can_castle_queenside_white = false,
-       can_castle_kingside_black = false, can_castle_queenside_black = false;
+  // Bitwise or of CastlingRight.
+  uint8_t castling_rights = 0;
+  // score(Color::WHITE). Fits in the padding after castling_rights.
+  int16_t white_score = 0;
   Position en_passant_target{-1, -1};
+
+  friend class BoardColumns;
+};
+
+// Many boards stored column by column: the same bitboard of every board sits
+// contiguously, so a pass over one piece type or color of all of them streams
+// through memory, and simple per-board tests vectorize.
+class BoardColumns {
+ public:
+  size_t size() const { return hashes.size(); }
+  void reserve(size_t n);
+  void push_back(const Board &board);
+
+  // The i-th board, exactly as it was added.
+  Board get(size_t i) const;
+
+  // Each board's pieces of one color.
+  const std::vector<Bitboard> &color_column(Color color) const {
+    return colors[color == Color::WHITE ? 0 : 1];
+  }
+  // Each board's pieces of one type, for every type except EMPTY and KING.
+  // Kings are the occupied squares no other type claims.
+  const std::vector<Bitboard> &type_column(PieceType type) const {
+    return types[Board::type_slot(type)];
+  }
+
+ private:
+  std::array<std::vector<Bitboard>, 5> types;
+  std::array<std::vector<Bitboard>, 2> colors;
+  std::vector<uint64_t> hashes;
+  std::vector<int16_t> scores;
+  std::vector<uint8_t> castling_rights;
+  std::vector<Position> en_passant_targets;
 };
 
 }  // namespace chess
+
+namespace std {
+
+template <>
+struct hash<chess::Board> {
+  size_t operator()(const chess::Board &board) const { return board.hash(); }
+};
+
+}  // namespace std
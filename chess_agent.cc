@@ -1,5 +1,11 @@
 #include "chess_agent.h"
 
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+#include "logging.h"
+
 namespace chess {
 
 namespace agent {
@@ -18,85 +24,142 @@ std::vector<std::pair<Move, Piece>> black_starting_moves = {
     {Move{{1, 3}, {0, 4}}, Piece{Color::BLACK, PieceType::BISHOP}},
 };
 
-ChessAgent::ChessAgent()
-    : particle_filter(
-          std::vector<Board>(kNumParticles, Board::initial_board())) {}
+ChessAgent::ChessAgent(int num_threads, SearchMode search_mode)
+    : particle_filter(Board::initial_board(), kNumParticles),
+      search_mode(search_mode) {
+  ThreadPool::global().resize(num_threads);
+}
 
 void ChessAgent::handle_game_start(Color color) {
   // Reinitialize the particle filter
   our_color = color;
+  moves_made = 0;
+  clock_seconds = 0;
+  search_tree.reset();
 }
 
 void ChessAgent::handle_opponent_move_result(bool captured_piece,
                                              Position captured_square) {
   particle_filter.handle_opponent_move_result(captured_piece, captured_square,
                                               opponent(our_color));
+  search_tree.advance_opponent_move(captured_piece, captured_square);
 }
 
 Position ChessAgent::choose_sense(std::vector<Position> possible_sense,
                                   std::vector<Move> possible_moves,
                                   double seconds_left) {
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::duration<double>(
+                      std::min(kSenseSeconds, move_budget(seconds_left)));
+
+  // The windows we're allowed to sense, by top-left square, each with a sense
+  // that shows it. Senses on the edge show the nearest full window.
+  std::map<Position, Position> windows;
+  for (Position sense : possible_sense) {
+    Position origin{std::max(0, std::min(5, sense.rank - 1)),
+                    std::max(0, std::min(5, sense.file - 1))};
+    Position center{origin.rank + 1, origin.file + 1};
+    if (windows.find(origin) == windows.end() || sense == center) {
+      windows[origin] = sense;
+    }
+  }
+  if (windows.empty()) {
+    for (int i = 0; i < 6; i++) {
+      for (int j = 0; j < 6; j++) {
+        windows[Position{i, j}] = Position{i + 1, j + 1};
+      }
+    }
+  }
+
+  // Every pass below looks at the same squares of every particle, so lay
+  // the particles out by column once.
+  ColumnarDistribution columns(particle_filter);
+
+  // Rank the windows by the sum of their squares' entropies. That's cheap,
+  // but overcounts squares that are uncertain together, like the two ends of
+  // a piece's possible move.
   std::array<std::array<double, 8>, 8> entropies;
   for (auto &r : entropies) {
     r.fill(0);
   }
-
-  particle_filter.entropy(entropies, our_color);
-
-  double max_entropy_sum = 0.0;
-  // Track the best top-left square
-  Position max_entropy_position = Position::NONE;
-  for (int i = 0; i < 6; i++) {
-    for (int j = 0; j < 6; j++) {
-      double total_entropy = 0;
-      for (int ii = 0; ii < 3; ii++) {
-        for (int jj = 0; jj < 3; jj++) {
-          total_entropy += entropies[i + ii][j + jj];
-        }
-      }
-      if (total_entropy > max_entropy_sum) {
-        max_entropy_sum = total_entropy;
-        max_entropy_position = {i, j};
+  columns.entropy(entropies, our_color);
+
+  std::vector<std::pair<double, Position>> ranked;
+  for (auto &w : windows) {
+    double total_entropy = 0;
+    for (int ii = 0; ii < 3; ii++) {
+      for (int jj = 0; jj < 3; jj++) {
+        total_entropy += entropies[w.first.rank + ii][w.first.file + jj];
       }
     }
+    ranked.emplace_back(total_entropy, w.first);
+  }
+  std::stable_sort(ranked.begin(), ranked.end(),
+                   [](const std::pair<double, Position> &a,
+                      const std::pair<double, Position> &b) {
+                     return a.first > b.first;
+                   });
+
+  // Then work down the ranking, judging windows by what we'd actually learn,
+  // for as long as there's time.
+  Position best = ranked[0].second;
+  double best_gain = -1;
+  for (auto &r : ranked) {
+    if (best_gain >= 0 && std::chrono::steady_clock::now() > deadline) {
+      break;
+    }
+    double gain = columns.observation_entropy(r.second);
+    if (gain > best_gain) {
+      best_gain = gain;
+      best = r.second;
+    }
   }
 
-  // Convert to center square
-  return {max_entropy_position.rank + 1, max_entropy_position.file + 1};
+  return windows[best];
 }
 
 void ChessAgent::handle_sense_result(Observation sense_result) {
   particle_filter.observe(sense_result, our_color);
+  search_tree.observe(sense_result);
+}
+
+double ChessAgent::move_budget(double seconds_left) const {
+  int moves_left = std::max(kMinMovesLeft, kExpectedGameMoves - moves_made);
+  return std::max(0.0, seconds_left - kReserveSeconds) / moves_left;
 }
 
 Move ChessAgent::choose_move(double seconds_left) {
+  if (clock_seconds == 0) {
+    clock_seconds = seconds_left;
+  }
+  double budget = move_budget(seconds_left);
+  moves_made++;
+
   auto &starter_moves =
       our_color == Color::WHITE ? white_starting_moves : black_starting_moves;
-  std::cout << opening_state << ", " << starter_moves.size() << std::endl;
+  CHESS_LOG(VERBOSE) << opening_state << ", " << starter_moves.size();
   if (opening_state != -1 && opening_state < starter_moves.size()) {
     auto starter_move = starter_moves[opening_state];
     if (particle_filter.particles[0].get_piece(starter_move.first.from.rank,
                                                starter_move.first.from.file) ==
         starter_move.second) {
       opening_state++;
-      std::cout << "OPENING MOVE " << opening_state << std::endl;
+      CHESS_LOG(INFO) << "OPENING MOVE " << opening_state;
+      search_tree.reset();
       return starter_move.first;
     } else {
-      std::cout << "OPENING CANCELLED" << std::endl;
+      CHESS_LOG(INFO) << "OPENING CANCELLED";
       opening_state = -1;
     }
   }
 
-  OurUctNode root(particle_filter.subsample(kNumParticlesRollout), our_color);
-  double frac_taken = (600 - seconds_left) / 600.0;
+  double frac_taken =
+      clock_seconds > 0 ? (clock_seconds - seconds_left) / clock_seconds : 0;
   int rollout_depth = kRolloutDepth * (1 - frac_taken * frac_taken);
-  int num_iters = 1000 * (1 - frac_taken * frac_taken);
-  ::std::cout << "Number of iterations: " << num_iters << ::std::endl;
-  ::std::cout << "Rollout: " << rollout_depth << ::std::endl;
-  for (int i = 0; i < num_iters; i++) {
-    root.simulate(rollout_depth);
-  }
-  return root.find_best_entry().our_move;
+  CHESS_LOG(INFO) << "Search seconds: " << budget;
+  CHESS_LOG(INFO) << "Rollout: " << rollout_depth;
+  return search_tree.search(particle_filter, our_color, search_mode, budget,
+                            rollout_depth);
 }
 
 void ChessAgent::handle_move_result(Move taken_move, bool capture,
@@ -105,12 +168,13 @@ void ChessAgent::handle_move_result(Move taken_move, bool capture,
       our_color == Color::WHITE ? white_starting_moves : black_starting_moves;
   if (opening_state > 0 && opening_state - 1 < starter_moves.size() &&
       taken_move.to != starter_moves[opening_state - 1].first.to) {
-    std::cout << "OPENING CANCELLED 2" << std::endl;
+    CHESS_LOG(INFO) << "OPENING CANCELLED 2";
     opening_state = -1;
   }
 
   particle_filter.handle_move_result(taken_move, our_color, capture,
                                      captured_square);
+  search_tree.advance_our_move(taken_move);
 }
 
 void ChessAgent::handle_game_end(Color winner_color, std::string reason) {}
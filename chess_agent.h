@@ -1,8 +1,10 @@
-#include <random>
+#include <cstdint>
 
 #include "chess.h"
 #include "particle_filter.h"
+#include "thread_pool.h"
 #include "uct.h"
+#include "util.h"
 
 namespace chess {
 
@@ -10,9 +12,28 @@ namespace agent {
 
 constexpr int kRolloutDepth = 15;
 
+// Our moves in a typical game, for splitting the clock between moves.
+constexpr int kExpectedGameMoves = 50;
+// Always plan as if at least this many moves are left.
+constexpr int kMinMovesLeft = 10;
+// Clock time kept back for sensing and particle filter updates.
+constexpr double kReserveSeconds = 5;
+// The most time to spend choosing where to sense.
+constexpr double kSenseSeconds = 0.5;
+
 class ChessAgent {
  public:
-  ChessAgent();
+  // Particle filter updates and the move search are spread over
+  // `num_threads` threads, or one per core if 0.
+  explicit ChessAgent(int num_threads = 0,
+                      SearchMode search_mode = SearchMode::ROOT_PARALLEL);
+
+  void set_search_mode(SearchMode mode) { search_mode = mode; }
+
+  // Make the agent's choices reproducible. Seeds the calling thread's random
+  // stream, which the thread pool's streams derive from, so calls must come
+  // from the same thread.
+  void seed(uint64_t seed) { get_random_engine().seed(seed); }
 
   void handle_game_start(Color color);
   void handle_opponent_move_result(bool captured_piece,
@@ -31,9 +52,18 @@ class ChessAgent {
   void handle_game_end(Color winner_color, std::string reason);
 
  private:
-  std::default_random_engine generator;
+  // Seconds to spend searching for this move.
+  double move_budget(double seconds_left) const;
+
   StateDistribution particle_filter;
   Color our_color;
+  SearchMode search_mode;
+  // Kept between turns, following what actually happened.
+  SearchTree search_tree;
+
+  // Our moves so far, and the clock at our first move.
+  int moves_made = 0;
+  double clock_seconds = 0;
 
   // -1 for aborted.
   int opening_state = 0;
@@ -0,0 +1,279 @@
+// Benchmarks for the move generator, the particle filter and the UCT search.
+//
+//   bazel run -c opt //:chess_benchmark -- --benchmark_out=results.json
+//
+// writes the results as JSON as well as printing them.
+//
+// Every benchmark seeds the random stream the same way, so runs are
+// comparable from one release to the next.
+#include <benchmark/benchmark.h>
+
+#include <cctype>
+
+#include "chess.h"
+#include "particle_filter.h"
+#include "uct.h"
+#include "util.h"
+
+namespace chess {
+
+namespace agent {
+
+namespace {
+
+constexpr uint64_t kSeed = 1;
+
+// A board from eight rows of symbols as Piece::get_symbol prints them, rank 7
+// first, with '.' for an empty square.
+Board parse_board(const char *const rows[8]) {
+  std::array<std::array<Piece, 8>, 8> pieces;
+  for (int row = 0; row < 8; row++) {
+    for (int file = 0; file < 8; file++) {
+      char symbol = rows[row][file];
+      Piece piece = Piece::EMPTY;
+      if (symbol != '.') {
+        piece.color = std::isupper(symbol) ? Color::WHITE : Color::BLACK;
+        switch (std::tolower(symbol)) {
+          case 'p':
+            piece.type = PieceType::PAWN;
+            break;
+          case 'n':
+            piece.type = PieceType::KNIGHT;
+            break;
+          case 'b':
+            piece.type = PieceType::BISHOP;
+            break;
+          case 'r':
+            piece.type = PieceType::ROOK;
+            break;
+          case 'q':
+            piece.type = PieceType::QUEEN;
+            break;
+          default:
+            piece.type = PieceType::KING;
+            break;
+        }
+      }
+      pieces[7 - row][file] = piece;
+    }
+  }
+  return Board(pieces);
+}
+
+const char *const kMiddlegame[8] = {
+    "r.bq.rk.",  //
+    "pp..bppp",  //
+    "..n.pn..",  //
+    "..pp....",  //
+    "...P.B..",  //
+    "..PBPN..",  //
+    "PP.N.PPP",  //
+    "R..QK..R",  //
+};
+
+const char *const kEndgame[8] = {
+    "........",  //
+    ".....pk.",  //
+    "......p.",  //
+    "..r.....",  //
+    "....P...",  //
+    ".....PK.",  //
+    "R.....P.",  //
+    "........",  //
+};
+
+// Fixtures by benchmark argument: 0 is the opening, 1 a middlegame and 2 an
+// endgame, all with white to move.
+Board fixture(int index) {
+  switch (index) {
+    case 1:
+      return parse_board(kMiddlegame);
+    case 2:
+      return parse_board(kEndgame);
+    default:
+      return Board::initial_board();
+  }
+}
+
+void Fixtures(benchmark::internal::Benchmark *b) {
+  b->ArgName("fixture")->DenseRange(0, 2);
+}
+
+// Beliefs about the opening after a few unseen black moves: `num` particles,
+// each from its own random line.
+StateDistribution spread_beliefs(int num) {
+  get_random_engine().seed(kSeed);
+  std::vector<Board> boards;
+  boards.reserve(num);
+  for (int i = 0; i < num; i++) {
+    Board b = Board::initial_board();
+    for (int ply = 0; ply < 3; ply++) {
+      b.do_random_move(Color::BLACK);
+    }
+    boards.push_back(b);
+  }
+  return StateDistribution(std::move(boards));
+}
+
+void ParticleCounts(benchmark::internal::Benchmark *b) {
+  b->ArgName("particles")->Arg(1000)->Arg(10000)->Arg(100000);
+  b->Unit(benchmark::kMillisecond);
+}
+
+// Sensing the middle of black's side, where the spread is widest.
+Observation sense(const Board &board) {
+  Observation obs;
+  obs.origin = {4, 3};
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      obs.obs[i][j] = board.get_piece(4 + i, 3 + j);
+    }
+  }
+  return obs;
+}
+
+void BM_GenerateMoves(benchmark::State &state) {
+  Board board = fixture(state.range(0));
+  MoveList moves;
+  for (auto _ : state) {
+    board.generate_moves(Color::WHITE, moves);
+    benchmark::DoNotOptimize(moves.size());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GenerateMoves)->Apply(Fixtures);
+
+// Every white move and every black reply: perft to depth 2.
+void BM_GenerateMovesTwoPly(benchmark::State &state) {
+  Board board = fixture(state.range(0));
+  MoveList moves, replies;
+  board.generate_moves(Color::WHITE, moves);
+  size_t nodes = 0;
+  for (auto _ : state) {
+    for (Move move : moves) {
+      Board after = board;
+      after.apply_move(move);
+      after.generate_moves(Color::BLACK, replies);
+      nodes += replies.size();
+    }
+  }
+  state.SetItemsProcessed(nodes);
+}
+BENCHMARK(BM_GenerateMovesTwoPly)->Apply(Fixtures);
+
+void BM_ApplyMove(benchmark::State &state) {
+  Board board = fixture(state.range(0));
+  std::vector<Move> moves = board.generate_moves(Color::WHITE);
+  size_t applied = 0;
+  for (auto _ : state) {
+    for (Move move : moves) {
+      Board after = board;
+      benchmark::DoNotOptimize(after.apply_move(move));
+    }
+    applied += moves.size();
+  }
+  state.SetItemsProcessed(applied);
+}
+BENCHMARK(BM_ApplyMove)->Apply(Fixtures);
+
+void BM_DoRandomMove(benchmark::State &state) {
+  Board board = fixture(state.range(0));
+  get_random_engine().seed(kSeed);
+  for (auto _ : state) {
+    Board after = board;
+    benchmark::DoNotOptimize(after.do_random_move(Color::WHITE));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DoRandomMove)->Apply(Fixtures);
+
+void BM_Update(benchmark::State &state) {
+  StateDistribution beliefs = spread_beliefs(state.range(0));
+  // Black can't reach g1 in three moves.
+  Move develop{{0, 6}, {2, 5}};
+  MoveOutcomes outcomes;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        beliefs.update(develop, Color::WHITE, &outcomes));
+  }
+  state.counters["unique"] = beliefs.particles.size();
+}
+BENCHMARK(BM_Update)->Apply(ParticleCounts);
+
+void BM_UpdateRandom(benchmark::State &state) {
+  StateDistribution beliefs = spread_beliefs(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(beliefs.update_random(Color::BLACK));
+  }
+  state.counters["unique"] = beliefs.particles.size();
+}
+BENCHMARK(BM_UpdateRandom)->Apply(ParticleCounts);
+
+void BM_Observe(benchmark::State &state) {
+  StateDistribution beliefs = spread_beliefs(state.range(0));
+  Observation obs = sense(beliefs.particles[0]);
+  for (auto _ : state) {
+    state.PauseTiming();
+    StateDistribution copy = beliefs;
+    state.ResumeTiming();
+    copy.observe(obs, Color::WHITE);
+  }
+  state.counters["unique"] = beliefs.particles.size();
+}
+BENCHMARK(BM_Observe)->Apply(ParticleCounts);
+
+void BM_Entropy(benchmark::State &state) {
+  StateDistribution beliefs = spread_beliefs(state.range(0));
+  std::array<std::array<double, 8>, 8> entropies;
+  for (auto _ : state) {
+    for (auto &r : entropies) {
+      r.fill(0);
+    }
+    beliefs.entropy(entropies, Color::WHITE);
+    benchmark::DoNotOptimize(entropies);
+  }
+  state.counters["unique"] = beliefs.particles.size();
+}
+BENCHMARK(BM_Entropy)->Apply(ParticleCounts);
+
+// What choose_sense does: lay the particles out by column, then take the
+// square entropies and every window's observation entropy.
+void BM_SenseScores(benchmark::State &state) {
+  StateDistribution beliefs = spread_beliefs(state.range(0));
+  std::array<std::array<double, 8>, 8> entropies;
+  for (auto _ : state) {
+    ColumnarDistribution columns(beliefs);
+    for (auto &r : entropies) {
+      r.fill(0);
+    }
+    columns.entropy(entropies, Color::WHITE);
+    for (int i = 0; i < 6; i++) {
+      for (int j = 0; j < 6; j++) {
+        benchmark::DoNotOptimize(columns.observation_entropy({i, j}));
+      }
+    }
+  }
+  state.counters["unique"] = beliefs.particles.size();
+}
+BENCHMARK(BM_SenseScores)->Apply(ParticleCounts);
+
+// Simulations per second from a fresh tree, as a search would start.
+void BM_UctSimulate(benchmark::State &state) {
+  Board board = fixture(state.range(0));
+  get_random_engine().seed(kSeed);
+  UctArena arena;
+  OurUctNode root(board, Color::WHITE, arena);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(root.simulate(10));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_UctSimulate)->Apply(Fixtures);
+
+}  // namespace
+
+}  // namespace agent
+
+}  // namespace chess
+
+BENCHMARK_MAIN();
@@ -1,6 +1,13 @@
+#include <algorithm>
+#include <random>
+#include <unordered_set>
 #include <utility>
 #include <gtest/gtest.h>
+#include "attacks.h"
 #include "chess.h"
+#include "perft.h"
+#include "thread_pool.h"
+#include "util.h"
 
 namespace chess {
 
@@ -11,6 +18,74 @@ TEST(Chess, ReprSizes) {
     EXPECT_LT(sizeof(Board), 80);
 }
 
+TEST(Chess, ScoreFollowsMoves) {
+    // Both sides start level.
+    EXPECT_EQ(Board::initial_board().score(Color::WHITE), 0);
+
+    get_random_engine().seed(9);
+    for (int game = 0; game < 20; game++) {
+        Board board = Board::initial_board();
+        for (int ply = 0; ply < 60; ply++) {
+            MoveResult result =
+                board.do_random_move(ply % 2 ? Color::BLACK : Color::WHITE);
+            ASSERT_EQ(board.score(Color::WHITE), board.compute_score());
+            ASSERT_EQ(board.score(Color::BLACK), -board.compute_score());
+            if (result.capture.piece.type == PieceType::KING) {
+                break;
+            }
+        }
+    }
+}
+
+TEST(Chess, BitboardQueries) {
+    Board board = Board::initial_board();
+    EXPECT_EQ(board.occupancy(Color::WHITE), 0x000000000000FFFFULL);
+    EXPECT_EQ(board.occupancy(Color::BLACK), 0xFFFF000000000000ULL);
+    EXPECT_EQ(board.occupancy(Color::EMPTY), 0x0000FFFFFFFF0000ULL);
+    EXPECT_EQ(board.pieces(Color::WHITE, PieceType::KING), square_bb(0, 4));
+    EXPECT_EQ(board.pieces(Color::BLACK, PieceType::QUEEN), square_bb(7, 3));
+    EXPECT_EQ(board.pieces(PieceType::PAWN), 0x00FF00000000FF00ULL);
+
+    board.set_piece(0, 4, Piece{Color::BLACK, PieceType::KNIGHT});
+    EXPECT_EQ(board.pieces(PieceType::KING), square_bb(7, 4));
+    EXPECT_EQ(board.get_piece(0, 4), (Piece{Color::BLACK, PieceType::KNIGHT}));
+    board.set_piece(0, 4, Piece::EMPTY);
+    EXPECT_EQ(board.get_piece(0, 4), Piece::EMPTY);
+    EXPECT_EQ(board.occupancy(Color::WHITE), 0x000000000000FFEFULL);
+}
+
+Bitboard slow_slide(int square, int dr, int df, Bitboard blockers) {
+    Bitboard result = 0;
+    int rank = square / 8 + dr, file = square % 8 + df;
+    while (0 <= rank && rank < 8 && 0 <= file && file < 8) {
+        result |= square_bb(rank, file);
+        if (blockers & square_bb(rank, file)) {
+            break;
+        }
+        rank += dr;
+        file += df;
+    }
+    return result;
+}
+
+TEST(Chess, SlidingAttacks) {
+    const AttackTables &tables = AttackTables::get();
+    std::mt19937_64 rng(7);
+    for (int i = 0; i < 1000; i++) {
+        int square = i % 64;
+        Bitboard blockers = rng() & rng();
+        EXPECT_EQ(tables.rook(square, blockers),
+                  slow_slide(square, 1, 0, blockers) | slow_slide(square, -1, 0, blockers) |
+                  slow_slide(square, 0, 1, blockers) | slow_slide(square, 0, -1, blockers));
+        EXPECT_EQ(tables.bishop(square, blockers),
+                  slow_slide(square, 1, 1, blockers) | slow_slide(square, 1, -1, blockers) |
+                  slow_slide(square, -1, 1, blockers) | slow_slide(square, -1, -1, blockers));
+    }
+    EXPECT_EQ(tables.between(square_index(0, 0), square_index(0, 3)),
+              square_bb(0, 1) | square_bb(0, 2));
+    EXPECT_EQ(tables.between(square_index(0, 0), square_index(1, 2)), 0);
+}
+
 void expect_moves(
         Board board, Color turn,
         std::vector<std::pair<Position, Position>> expected_moves) {
@@ -68,6 +143,19 @@ TEST(Chess, InitialBoard) {
     });
 }
 
+TEST(Chess, MoveListMatchesVector) {
+    Board board = Board::initial_board();
+    MoveList moves;
+    moves.push_back(Move{{0, 0}, {1, 1}});
+    board.generate_moves(Color::BLACK, moves);
+    std::vector<Move> expected = board.generate_moves(Color::BLACK);
+    ASSERT_EQ(moves.size(), expected.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+        EXPECT_EQ(moves[i].from, expected[i].from);
+        EXPECT_EQ(moves[i].to, expected[i].to);
+    }
+}
+
 TEST(Chess, BasicPawnMoves) {
     chess::Board board;
     board.set_piece(1, 0, chess::Piece{chess::Color::WHITE, chess::PieceType::PAWN});
@@ -284,6 +372,7 @@ TEST(Chess, KnightMoves) {
 
 TEST(Chess, Castling) {
     Board board = Board::initial_board();
+    board.allow_castling(Color::WHITE);
 
     /*   0 1 2 3 4 5 6 7
      * 7|r n b q k b n r
@@ -297,7 +386,7 @@ TEST(Chess, Castling) {
      */
 
     {
-        // No castling allowed with default board
+        // No castling while the back rank is blocked
         auto king_moves = board.generate_moves(Color::WHITE);
         king_moves.erase(std::remove_if(
                     king_moves.begin(), king_moves.end(),
@@ -404,6 +493,112 @@ TEST(Chess, Castling) {
     }
 }
 
+TEST(Chess, PerftFromInitialBoard) {
+    // Pawn captures onto empty squares are moves too, hence 34 rather than 20.
+    Board board = Board::initial_board();
+    const uint64_t expected[] = {1, 34, 1156, 40146};
+    for (int depth = 0; depth < 4; depth++) {
+        EXPECT_EQ(perft(board, Color::WHITE, depth), expected[depth]);
+        EXPECT_EQ(perft(board, Color::WHITE, depth, false), expected[depth]);
+    }
+
+    ThreadPool::global().resize(4);
+    EXPECT_EQ(perft_parallel(board, Color::WHITE, 3), expected[3]);
+    uint64_t total = 0;
+    for (auto &m : perft_divide(board, Color::WHITE, 3)) {
+        total += m.second;
+    }
+    EXPECT_EQ(total, expected[3]);
+    ThreadPool::global().resize(1);
+}
+
+TEST(Chess, PerftStopsAtKingCapture) {
+    Board board;
+    board.set_piece(0, 0, Piece{Color::WHITE, PieceType::ROOK});
+    board.set_piece(0, 7, Piece{Color::WHITE, PieceType::KING});
+    board.set_piece(7, 0, Piece{Color::BLACK, PieceType::KING});
+
+    uint64_t expected = 0;
+    for (Move move : board.generate_moves(Color::WHITE)) {
+        Board after = board;
+        if (after.apply_move(move).capture.piece.type != PieceType::KING) {
+            expected += after.generate_moves(Color::BLACK).size();
+        }
+    }
+    EXPECT_EQ(perft(board, Color::WHITE, 2), expected);
+    EXPECT_EQ(perft(board, Color::WHITE, 2, false), expected);
+}
+
+TEST(Chess, RandomMoveIsUniformOverMoves) {
+    Board board;
+    // 2 knight moves and 27 queen moves.
+    board.set_piece(0, 0, Piece{Color::WHITE, PieceType::KNIGHT});
+    board.set_piece(4, 4, Piece{Color::WHITE, PieceType::QUEEN});
+
+    int knight_moves = 0;
+    for (int i = 0; i < 5000; i++) {
+        Board copy = board;
+        if (copy.do_random_move(Color::WHITE).move.from == Position{0, 0}) {
+            knight_moves++;
+        }
+    }
+    EXPECT_GT(knight_moves, 5000 * 0.03);
+    EXPECT_LT(knight_moves, 5000 * 0.11);
+
+    Board empty;
+    EXPECT_EQ(empty.do_random_move(Color::WHITE).move.from, Position::NONE);
+}
+
+TEST(Chess, RandomMoveWeighted) {
+    Board board;
+    board.set_piece(0, 0, Piece{Color::WHITE, PieceType::KNIGHT});
+    board.set_piece(4, 4, Piece{Color::WHITE, PieceType::QUEEN});
+
+    MoveWeights only_knight = [](const Board &b, Move m) {
+        return b.get_piece(m.from.rank, m.from.file).type == PieceType::KNIGHT
+                   ? 1.0 : 0.0;
+    };
+    for (int i = 0; i < 100; i++) {
+        Board copy = board;
+        EXPECT_EQ(copy.do_random_move(Color::WHITE, only_knight).move.from,
+                  (Position{0, 0}));
+    }
+}
+
+TEST(Chess, ZobristHash) {
+    EXPECT_EQ(Board().hash(), 0);
+
+    std::mt19937 rng(3);
+    for (int game = 0; game < 20; game++) {
+        Board board = Board::initial_board();
+        for (int i = 0; i < 60; i++) {
+            std::vector<Move> moves = board.generate_moves(i % 2 ? Color::BLACK : Color::WHITE);
+            board.apply_move(moves[rng() % moves.size()]);
+            ASSERT_EQ(board.hash(), board.compute_hash());
+        }
+    }
+
+    // Transpositions hash equal.
+    Board a = Board::initial_board(), b = Board::initial_board();
+    a.apply_move({{0, 1}, {2, 2}});
+    a.apply_move({{0, 6}, {2, 5}});
+    b.apply_move({{0, 6}, {2, 5}});
+    b.apply_move({{0, 1}, {2, 2}});
+    EXPECT_EQ(a.hash(), b.hash());
+    EXPECT_EQ(a, b);
+
+    // The en passant target is part of the position.
+    Board c = Board::initial_board(), d = Board::initial_board();
+    c.apply_move({{1, 4}, {3, 4}});
+    d.set_piece(1, 4, Piece::EMPTY);
+    d.set_piece(3, 4, Piece{Color::WHITE, PieceType::PAWN});
+    EXPECT_NE(c.hash(), d.hash());
+    EXPECT_NE(c, d);
+
+    std::unordered_set<Board> boards = {a, b, c, d};
+    EXPECT_EQ(boards.size(), 3);
+}
+
 TEST(Chess, BasicMove) {
     chess::Board board;
     board.set_piece(3, 3, Piece{Color::WHITE, PieceType::QUEEN});
@@ -473,7 +668,7 @@ TEST(Chess, EnPassant) {
                 }
             ), ep_pawn_moves.end());
     ASSERT_EQ(ep_pawn_moves.size(), 1);
-    Capture cap = board.apply_move(ep_pawn_moves[0]);
+    Capture cap = board.apply_move(ep_pawn_moves[0]).capture;
     EXPECT_EQ(board.get_piece(5, 1).color, Color::WHITE);
     EXPECT_EQ(board.get_piece(5, 1).type, PieceType::PAWN);
     EXPECT_EQ(board.get_piece(4, 0).color, Color::EMPTY);
@@ -551,6 +746,18 @@ void compare_tracking(Board board, std::vector<PieceType> tracked, Color color)
     }
 }
 
+TEST(Chess, WastedMoveEndsEnPassant) {
+    // b2-b4, then black wastes a pawn capture onto an empty square. White's
+    // own a2-b3 must not capture "en passant" behind its own pawn.
+    Board board = Board::initial_board();
+    board.apply_move(Move{{1, 1}, {3, 1}});
+    board.apply_move(Move{{6, 0}, {5, 1}});
+    MoveResult result = board.apply_move(Move{{1, 0}, {2, 1}});
+    EXPECT_EQ(result.capture, Capture::NONE);
+    EXPECT_EQ(board.get_piece(3, 1), (Piece{Color::WHITE, PieceType::PAWN}));
+    EXPECT_EQ(board.hash(), board.compute_hash());
+}
+
 TEST(Chess, TrackCaptures) {
     std::vector<PieceType> starting_pieces = {
         PieceType::PAWN,
@@ -577,21 +784,21 @@ TEST(Chess, TrackCaptures) {
 
         for (int i = 0; i < 35; i++) {
             Move white_move = choose_random(board.generate_moves(Color::WHITE));
-            Capture captured_black = board.apply_move(white_move);
+            Capture captured_black = board.apply_move(white_move).capture;
 
             if (captured_black != Capture::NONE) {
                 auto captured_black_it = std::find(
-                        pieces_black.begin(), pieces_black.end(), captured_black.piece.type);
+                        pieces_black.begin(), pieces_black.end(), PieceType(captured_black.piece.type));
                 ASSERT_NE(captured_black_it, pieces_black.end());
                 pieces_black.erase(captured_black_it);
             }
 
             Move black_move = choose_random(board.generate_moves(Color::BLACK));
-            Capture captured_white = board.apply_move(black_move);
+            Capture captured_white = board.apply_move(black_move).capture;
 
             if (captured_white != Capture::NONE) {
                 auto captured_white_it = std::find(
-                        pieces_white.begin(), pieces_white.end(), captured_white.piece.type);
+                        pieces_white.begin(), pieces_white.end(), PieceType(captured_white.piece.type));
                 ASSERT_NE(captured_white_it, pieces_white.end());
                 pieces_white.erase(captured_white_it);
             }
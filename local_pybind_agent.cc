@@ -3,10 +3,19 @@
 namespace py = pybind11;
 
 using chess::agent::ChessAgent;
+using chess::agent::SearchMode;
 
 PYBIND11_MODULE(chess_agent, m) {
+  py::enum_<SearchMode>(m, "SearchMode")
+      .value("SERIAL", SearchMode::SERIAL)
+      .value("ROOT_PARALLEL", SearchMode::ROOT_PARALLEL)
+      .value("TREE_PARALLEL", SearchMode::TREE_PARALLEL);
+
   py::class_<ChessAgent>(m, "ChessAgent")
-      .def(py::init<>())
+      .def(py::init<int, SearchMode>(), py::arg("num_threads") = 0,
+           py::arg("search_mode") = SearchMode::ROOT_PARALLEL)
+      .def("set_search_mode", &ChessAgent::set_search_mode)
+      .def("seed", &ChessAgent::seed)
       .def("handle_game_start", &ChessAgent::handle_game_start)
       .def("handle_opponent_move_result",
            &ChessAgent::handle_opponent_move_result)
@@ -0,0 +1,110 @@
+#include "logging.h"
+
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+namespace chess {
+
+namespace {
+
+const char *level_name(LogLevel level) {
+  switch (level) {
+    case LogLevel::VERBOSE:
+      return "V";
+    case LogLevel::INFO:
+      return "I";
+    case LogLevel::WARNING:
+      return "W";
+    case LogLevel::ERROR:
+      return "E";
+    default:
+      return "?";
+  }
+}
+
+}  // namespace
+
+constexpr size_t Logger::kMaxQueuedLines;
+
+Logger::Logger(std::ostream &out) : out(out) {
+  writer = std::thread(&Logger::writer_loop, this);
+}
+
+Logger::~Logger() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  writer.join();
+}
+
+Logger &Logger::global() {
+  static Logger logger(std::cout);
+  return logger;
+}
+
+void Logger::write(std::string line) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (queue.size() >= kMaxQueuedLines) {
+      dropped++;
+      return;
+    }
+    queue.push_back(std::move(line));
+  }
+  wake.notify_one();
+}
+
+void Logger::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  drained.wait(lock, [this] { return queue.empty() && !writing; });
+}
+
+void Logger::writer_loop() {
+  std::vector<std::string> batch;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    wake.wait(lock, [this] { return stopping || !queue.empty(); });
+    if (queue.empty()) {
+      // Stopping, and everything has been written.
+      return;
+    }
+    batch.assign(std::make_move_iterator(queue.begin()),
+                 std::make_move_iterator(queue.end()));
+    queue.clear();
+    size_t lost = dropped;
+    dropped = 0;
+    writing = true;
+
+    // Write the whole batch with a single flush, off the lock.
+    lock.unlock();
+    for (const std::string &line : batch) {
+      out << line << '\n';
+    }
+    if (lost > 0) {
+      out << "W logging: dropped " << lost << " lines\n";
+    }
+    out.flush();
+    batch.clear();
+    lock.lock();
+
+    writing = false;
+    if (queue.empty()) {
+      drained.notify_all();
+    }
+  }
+}
+
+LogMessage::LogMessage(LogLevel level, const char *file, int line) {
+  const char *base = std::strrchr(file, '/');
+  buffer << level_name(level) << ' ' << (base ? base + 1 : file) << ':' << line
+         << "] ";
+}
+
+LogMessage::~LogMessage() { Logger::global().write(buffer.str()); }
+
+}  // namespace chess
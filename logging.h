@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+// Levels below this are compiled out entirely, e.g. build with
+// -DCHESS_MIN_LOG_LEVEL=2 to keep only warnings and errors.
+#ifndef CHESS_MIN_LOG_LEVEL
+#define CHESS_MIN_LOG_LEVEL 0
+#endif
+
+namespace chess {
+
+enum class LogLevel { VERBOSE, INFO, WARNING, ERROR, OFF };
+
+// Collects log lines from any thread and writes them out on a background
+// thread, so logging never waits on the output stream. Lines from one thread
+// come out in the order they were logged.
+class Logger {
+ public:
+  // Lines allowed to wait for the writer. Past this, new lines are dropped
+  // and counted instead of holding up the caller.
+  static constexpr size_t kMaxQueuedLines = 4096;
+
+  explicit Logger(std::ostream &out);
+  // Writes out everything still queued.
+  ~Logger();
+
+  // Writes to std::cout, at INFO and above.
+  static Logger &global();
+
+  void set_level(LogLevel level) {
+    min_level.store(level, std::memory_order_relaxed);
+  }
+  bool enabled(LogLevel level) const {
+    return level >= min_level.load(std::memory_order_relaxed);
+  }
+
+  // Queue one line, without its newline.
+  void write(std::string line);
+
+  // Wait until every line queued so far has been written and flushed.
+  void flush();
+
+ private:
+  Logger(const Logger &) = delete;
+  Logger &operator=(const Logger &) = delete;
+
+  void writer_loop();
+
+  std::ostream &out;
+  std::atomic<LogLevel> min_level{LogLevel::INFO};
+
+  // Guards everything below.
+  std::mutex mutex;
+  std::condition_variable wake, drained;
+  std::deque<std::string> queue;
+  size_t dropped = 0;
+  // Lines taken off the queue but not yet flushed.
+  bool writing = false;
+  bool stopping = false;
+
+  std::thread writer;
+};
+
+// One log line, handed to the logger when it goes out of scope.
+class LogMessage {
+ public:
+  LogMessage(LogLevel level, const char *file, int line);
+  ~LogMessage();
+
+  std::ostream &stream() { return buffer; }
+
+ private:
+  std::ostringstream buffer;
+};
+
+}  // namespace chess
+
+// Usage: CHESS_LOG(INFO) << "Search seconds: " << budget;
+// Nothing after the macro is evaluated unless the level is enabled, and levels
+// below CHESS_MIN_LOG_LEVEL compile to nothing.
+#define CHESS_LOG(level)                                                  \
+  if (static_cast<int>(::chess::LogLevel::level) < CHESS_MIN_LOG_LEVEL || \
+      !::chess::Logger::global().enabled(::chess::LogLevel::level)) {     \
+  } else                                                                  \
+    ::chess::LogMessage(::chess::LogLevel::level, __FILE__, __LINE__).stream()
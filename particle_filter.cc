@@ -1,5 +1,12 @@
 #include "particle_filter.h"
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <unordered_map>
+#include "logging.h"
+#include "thread_pool.h"
 #include "util.h"
 
 namespace chess {
@@ -8,32 +15,44 @@ namespace agent {
 
 namespace {
 
-bool handle_board_piece_no_obs(Board &board, Piece board_piece,
-                               Position obs_pos, Position origin) {
-  while (true) {
-    Position new_pos;
-    if (board_piece.type == PieceType::BISHOP) {
-      int random_idx = random_int(32);
-      random_idx *= 2;
-      if ((obs_pos.rank + obs_pos.file % 2) == 0) {
-        new_pos = {random_idx / 8, random_idx % 8};
-      } else {
-        random_idx++;
-        new_pos = {random_idx / 8, random_idx % 8};
+// Where `board_piece`, seen not to be on `obs_pos`, could be instead: any
+// empty square, except the squares of the window at `origin` up to and
+// including `obs_pos`. Bishops stay on their color.
+Bitboard relocation_targets(const Board &board, Piece board_piece,
+                            Position obs_pos, Position origin) {
+  Bitboard targets = board.occupancy(Color::EMPTY);
+  int obs_square = square_index(obs_pos.rank, obs_pos.file);
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      int rank = origin.rank + i, file = origin.file + j;
+      if (rank < 8 && file < 8 && square_index(rank, file) <= obs_square) {
+        targets &= ~square_bb(rank, file);
       }
-    } else {
-      new_pos = {random_int(8), random_int(8)};
     }
+  }
+  if (board_piece.type == PieceType::BISHOP) {
+    targets &= (obs_pos.rank + obs_pos.file) % 2 == 0 ? kEvenSquares
+                                                       : ~kEvenSquares;
+  }
+  return targets;
+}
 
-    if (board.get_piece(new_pos.rank, new_pos.file) == Piece::EMPTY &&
-        !(new_pos.rank >= origin.rank && new_pos.rank < origin.rank + 3 &&
-          new_pos.file >= origin.file && new_pos.file < origin.file + 3 &&
-          new_pos.rank * 8 + new_pos.file <= obs_pos.rank * 8 + obs_pos.file)) {
-      board.set_piece(new_pos.rank, new_pos.file, board_piece);
-      board.set_piece(obs_pos.rank, obs_pos.file, Piece::EMPTY);
-      return true;
-    }
+// Move `board_piece` from `obs_pos` to one of its relocation_targets, drawn
+// uniformly. False if there are none.
+bool handle_board_piece_no_obs(Board &board, Piece board_piece,
+                               Position obs_pos, Position origin) {
+  Bitboard targets =
+      relocation_targets(board, board_piece, obs_pos, origin);
+  if (!targets) {
+    return false;
+  }
+  for (int skip = random_int(popcount(targets)); skip > 0; skip--) {
+    pop_lsb(targets);
   }
+  int square = lsb(targets);
+  board.set_piece(square / 8, square % 8, board_piece);
+  board.set_piece(obs_pos.rank, obs_pos.file, Piece::EMPTY);
+  return true;
 }
 
 bool handle_obs_piece_no_board(Board &board, Piece obs_piece, Position obs_pos,
@@ -57,16 +76,10 @@ bool handle_obs_piece_no_board(Board &board, Piece obs_piece, Position obs_pos,
   switch (obs_piece.type) {
     case PieceType::BISHOP: {
       if (res.size() == 0) {
-        ::std::cout << "Found no bishops" << std::endl;
         return false;
       } else if (res.size() == 1) {
         if ((res.at(0).rank + res.at(0).file) % 2 !=
             (obs_pos.rank + obs_pos.file) % 2) {
-          ::std::cout << "Looking for single bishop no match" << std::endl;
-          ::std::cout << "obs_pos: " << obs_pos << std::endl;
-          ::std::cout << "res 0: " << res.at(0) << std::endl;
-          ::std::cout << "temp_res size: " << temp_res.size() << std::endl;
-          board.debug_print(std::cout);
           return false;
         }
         selected = res.at(0);
@@ -81,7 +94,6 @@ bool handle_obs_piece_no_board(Board &board, Piece obs_piece, Position obs_pos,
         }
 
         if (!match) {
-          std::cout << "BISHOP NO MATCH" << std::endl;
           return false;
         }
       }
@@ -109,9 +121,11 @@ bool handle_obs_piece_no_board(Board &board, Piece obs_piece, Position obs_pos,
     case PieceType::QUEEN:
     case PieceType::KING: {
       if (res.size() == 0) {
-        ::std::cout << "Couldn't find piece " << obs_piece << std::endl;
         auto valid_pieces =
             board.find_all_valid_color(obs_piece.color, obs_pos);
+        if (valid_pieces.empty()) {
+          return false;
+        }
         auto chosen = random_choice(valid_pieces);
         auto chosen_piece = board.get_piece(chosen.rank, chosen.file);
         chosen_piece.type = obs_piece.type;
@@ -123,6 +137,9 @@ bool handle_obs_piece_no_board(Board &board, Piece obs_piece, Position obs_pos,
       selected = random_choice(res);
       break;
     }
+    case PieceType::EMPTY:
+      // Only called for squares seen to hold a piece.
+      return false;
   }
 
   assert(selected != Position::NONE);
@@ -131,202 +148,572 @@ bool handle_obs_piece_no_board(Board &board, Piece obs_piece, Position obs_pos,
 
   return true;
 }
-}  // namespace
 
-Board StateDistribution::sample() const { return random_choice(particles); }
+// Collects weighted boards for a new StateDistribution, merging duplicates.
+class ParticleAccumulator {
+ public:
+  void add(const Board &board, int weight) {
+    auto it = index.find(board.hash());
+    if (it == index.end()) {
+      index.emplace(board.hash(), boards.size());
+    } else if (boards[it->second] == board) {
+      weights[it->second] += weight;
+      return;
+    }
+    // A new board, or a hash collision: keep it as its own entry.
+    boards.push_back(board);
+    weights.push_back(weight);
+  }
 
-int piece_value(PieceType piece) {
-  switch (piece) {
-    case PieceType::PAWN:
-      return 1;
-    case PieceType::KING:
-      return 100;
-    case PieceType::QUEEN:
-      return 20;
-    case PieceType::KNIGHT:
-      return 10;
-    case PieceType::ROOK:
-      return 10;
-    case PieceType::BISHOP:
-      return 10;
-    default:
-      return 0;
+  // Add everything from `other`, in order.
+  void merge(const ParticleAccumulator &other) {
+    for (size_t i = 0; i < other.boards.size(); i++) {
+      add(other.boards[i], other.weights[i]);
+    }
+  }
+
+  bool empty() const { return boards.empty(); }
+
+  // Including weight added to existing boards.
+  int total_weight() const {
+    int result = 0;
+    for (int w : weights) {
+      result += w;
+    }
+    return result;
   }
+
+  StateDistribution build() {
+    index.clear();
+    return StateDistribution(std::move(boards), std::move(weights));
+  }
+
+ private:
+  std::vector<Board> boards;
+  std::vector<int> weights;
+  std::unordered_map<uint64_t, size_t> index;
+};
+
+// ParticleAccumulators for each outcome of some event, in order of first
+// appearance.
+template <typename Key>
+class GroupedAccumulator {
+ public:
+  ParticleAccumulator &operator[](const Key &key) {
+    auto it = indices.find(key);
+    if (it == indices.end()) {
+      it = indices.emplace(key, groups.size()).first;
+      keys.push_back(key);
+      groups.emplace_back();
+    }
+    return groups[it->second];
+  }
+
+  void merge(const GroupedAccumulator &other) {
+    for (size_t i = 0; i < other.keys.size(); i++) {
+      (*this)[other.keys[i]].merge(other.groups[i]);
+    }
+  }
+
+  std::vector<Key> keys;
+  std::vector<ParticleAccumulator> groups;
+
+ private:
+  std::map<Key, size_t> indices;
+};
+
+// Board::score of a typical position, which heuristic values are divided by.
+constexpr double kScoreScale = 188.0;
+
+// Particles a sampled CheckValid looks at.
+constexpr size_t kSampledChecks = 16;
+
+// Unique boards per chunk below which a pass isn't worth spreading over
+// threads.
+constexpr size_t kMinParticlesPerChunk = 32;
+
+// Run fn(begin, end, &accumulator) over chunks of [0, n) on the global thread
+// pool, then merge the per-chunk accumulators in chunk order.
+template <typename Accumulator, typename Fn>
+Accumulator accumulate_parallel(size_t n, Fn fn) {
+  ThreadPool &pool = ThreadPool::global();
+  std::vector<Accumulator> chunks(pool.num_chunks(n, kMinParticlesPerChunk));
+  pool.parallel_for(n, kMinParticlesPerChunk,
+                    [&](size_t chunk, size_t begin, size_t end) {
+                      fn(begin, end, &chunks[chunk]);
+                    });
+  for (size_t i = 1; i < chunks.size(); i++) {
+    chunks[0].merge(chunks[i]);
+  }
+  return std::move(chunks[0]);
 }
 
-std::tuple<double, std::vector<std::tuple<int, Move, StateDistribution>>>
-StateDistribution::update(Move move, Color our_color) const {
-  int num_wins = 0;
-  int initial_size = particles.size();
+// Split `weight` particles between `n` equally likely outcomes, as if each
+// particle chose independently. Avoids copying a board per particle.
+void split_weight(int weight, size_t n, std::vector<int> *counts) {
+  counts->assign(n, 0);
+  for (int i = 0; i < weight; i++) {
+    (*counts)[random_int(n)]++;
+  }
+}
 
-  std::vector<std::tuple<int, Move, StateDistribution>> result;
-  std::map<Move, int> indices;
-  for (Board b : particles) {
-    assert(b.get_piece(move.from.rank, move.from.file).color == our_color);
-    MoveResult move_result = b.apply_move(move);
+// A sense result as bitboards over its window, so a board can be checked
+// against it with a few masked compares instead of nine get_piece calls.
+class SensedWindow {
+ public:
+  explicit SensedWindow(const Observation &obs) {
+    for (int i = 0; i < 3; i++) {
+      for (int j = 0; j < 3; j++) {
+        Bitboard square =
+            square_bb(obs.origin.rank + i, obs.origin.file + j);
+        Piece piece = obs.obs[i][j];
+        window |= square;
+        if (piece.color != Color::EMPTY) {
+          colors[piece.color == Color::WHITE ? 0 : 1] |= square;
+        }
+        for (size_t t = 0; t < kTypes.size(); t++) {
+          if (piece.type == kTypes[t]) {
+            types[t] |= square;
+          }
+        }
+      }
+    }
+  }
 
-    if (move_result.capture.piece.type == PieceType::KING) {
-      num_wins += 20;
+  // Whether `b` agrees with the sense result on every sensed square. Kings
+  // are whatever is occupied and not some other type, so they follow.
+  bool matches(const Board &b) const {
+    for (size_t t = 0; t < kTypes.size(); t++) {
+      if ((b.pieces(kTypes[t]) & window) != types[t]) {
+        return false;
+      }
     }
+    return (b.occupancy(Color::WHITE) & window) == colors[0] &&
+           (b.occupancy(Color::BLACK) & window) == colors[1];
+  }
 
-    if (indices.find(move_result.move) == indices.end()) {
-      indices[move_result.move] = result.size();
-      result.push_back(
-          std::make_tuple(1, move_result.move, StateDistribution({b})));
-    } else {
-      std::get<2>(result[indices[move_result.move]]).particles.push_back(b);
+  // matches for every board in `boards` at once, a column at a time:
+  // mismatched[k] is left zero exactly when board k matches.
+  void find_mismatches(const BoardColumns &boards,
+                       std::vector<Bitboard> *mismatched) const {
+    mismatched->assign(boards.size(), 0);
+    Bitboard *m = mismatched->data();
+    auto compare = [&](const std::vector<Bitboard> &column, Bitboard want) {
+      for (size_t k = 0; k < column.size(); k++) {
+        m[k] |= (column[k] & window) ^ want;
+      }
+    };
+    for (size_t t = 0; t < kTypes.size(); t++) {
+      compare(boards.type_column(kTypes[t]), types[t]);
     }
+    compare(boards.color_column(Color::WHITE), colors[0]);
+    compare(boards.color_column(Color::BLACK), colors[1]);
   }
 
-  for (auto &it : result) {
-    std::get<2>(it).CheckValid(our_color);
-    std::vector<Board> &it_particles = std::get<2>(it).particles;
-    while (it_particles.size() < particles.size()) {
-      Board b = random_choice(it_particles);
-      it_particles.push_back(b);
+ private:
+  static constexpr std::array<PieceType, 5> kTypes{
+      {PieceType::PAWN, PieceType::QUEEN, PieceType::ROOK, PieceType::KNIGHT,
+       PieceType::BISHOP}};
+
+  Bitboard window = 0;
+  std::array<Bitboard, 5> types{};
+  std::array<Bitboard, 2> colors{};
+};
+
+constexpr std::array<PieceType, 5> SensedWindow::kTypes;
+
+// The squares of the 3x3 window with top-left `origin`.
+Bitboard window_mask(Position origin) {
+  Bitboard window = 0;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      window |= square_bb(origin.rank + i, origin.file + j);
     }
   }
+  return window;
+}
+
+// Adds each square's entropy to `out`, given the particle weight with each
+// kind of opponent piece there, indexed by PieceType, and with one of ours,
+// which doesn't count. Fills in piece_counts[EMPTY] on the way.
+void add_square_entropies(std::array<std::array<int, 64>, 7> &piece_counts,
+                          const std::array<int, 64> &our_counts, int total,
+                          std::array<std::array<double, 8>, 8> &out) {
+  for (int square = 0; square < 64; square++) {
+    int empty = total - our_counts[square];
+    for (int type = 1; type < 7; type++) {
+      empty -= piece_counts[type][square];
+    }
+    piece_counts[0][square] = empty;
+  }
+
+  // -sum p log p with p = c / total is (C log total - sum c log c) / total,
+  // where C is the sum of the counts.
+  double log_total = std::log2(static_cast<double>(total));
+  for (int square = 0; square < 64; square++) {
+    double counted = 0;
+    double c_log_c = 0;
+    for (auto &counts : piece_counts) {
+      int c = counts[square];
+      if (c != 0) {
+        counted += c;
+        c_log_c += c * std::log2(static_cast<double>(c));
+      }
+    }
+    out[square / 8][square % 8] += (counted * log_total - c_log_c) / total;
+  }
+}
+
+// The entropy of the outcomes in `shown`, each with its particle weight.
+double outcome_entropy(const std::unordered_map<uint64_t, int> &shown,
+                       int total) {
+  double entropy = 0;
+  for (auto &s : shown) {
+    double prob = static_cast<double>(s.second) / total;
+    entropy -= prob * std::log2(prob);
+  }
+  return entropy;
+}
+
+}  // namespace
+
+StateDistribution::StateDistribution(std::vector<Board> &&boards) {
+  ParticleAccumulator accumulator;
+  for (const Board &board : boards) {
+    accumulator.add(board, 1);
+  }
+  *this = accumulator.build();
+}
 
-  return std::make_tuple(((double)num_wins) / initial_size, result);
+int StateDistribution::total_weight() const {
+  int total = 0;
+  for (int w : weights) {
+    total += w;
+  }
+  return total;
 }
 
-double color_value(Color color, Color ours) {
-  if (color == ours) {
-    return 1;
-  } else if (color == opponent(ours)) {
-    return -1.0;
-  } else {
-    return 0;
+size_t StateDistribution::sample_index() const {
+  int choice = random_int(total_weight());
+  size_t i = 0;
+  while (choice >= weights[i]) {
+    choice -= weights[i++];
+  }
+  return i;
+}
+
+void StateDistribution::draw(int num, std::vector<int> *counts) const {
+  std::vector<int> cumulative(weights.size());
+  int total = 0;
+  for (size_t i = 0; i < weights.size(); i++) {
+    total += weights[i];
+    cumulative[i] = total;
+  }
+
+  counts->assign(weights.size(), 0);
+  for (int i = 0; i < num; i++) {
+    int choice = random_int(total);
+    (*counts)[std::upper_bound(cumulative.begin(), cumulative.end(), choice) -
+              cumulative.begin()]++;
   }
 }
 
-int mirrored_rank(Color color, int rank) {
-  if (color == Color::WHITE) {
-    return rank;
-  } else {
-    return 7 - rank;
+void StateDistribution::resample_to(int total) {
+  int missing = total - total_weight();
+  if (missing <= 0 || particles.empty()) {
+    return;
+  }
+  std::vector<int> extra;
+  draw(missing, &extra);
+  for (size_t i = 0; i < weights.size(); i++) {
+    weights[i] += extra[i];
   }
 }
 
+Board StateDistribution::sample() const { return particles[sample_index()]; }
+
 double StateDistribution::heuristic_value(Color color) const {
-  double piece_values = 0;
-  for (int c = 0; c < 10; c++) {
-    const Board &b = random_choice(particles);
-    for (int i = 0; i < 8; i++) {
-      for (int j = 0; j < 8; j++) {
-        Piece piece = b.get_piece(i, j);
-        piece_values +=
-            (piece_value(piece.type) + mirrored_rank(piece.color, i)) *
-            color_value(piece.color, color);
-      }
-    }
+  int64_t total = 0;
+  for (size_t i = 0; i < particles.size(); i++) {
+    total += static_cast<int64_t>(particles[i].score(color)) * weights[i];
   }
-  return piece_values / 10.0 / 188.0;
+  return total / static_cast<double>(total_weight()) / kScoreScale;
 }
 
-std::vector<std::tuple<int, Capture, StateDistribution>>
-StateDistribution::update_random(Color opponent_color) const {
-  std::vector<std::tuple<int, Capture, StateDistribution>> result;
-  std::map<Capture, int> indices;
-  for (Board b : particles) {
-    Capture capture = b.do_random_move(opponent_color).capture;
-    if (indices.find(capture) == indices.end()) {
-      indices[capture] = result.size();
-      result.push_back(std::make_tuple(1, capture, StateDistribution({b})));
-    } else {
-      std::get<2>(result[indices[capture]]).particles.push_back(b);
+double StateDistribution::update(Move move, Color our_color,
+                                 MoveOutcomes *outcomes) const {
+  int num_wins = 0;
+  std::vector<MoveOutcomes::Group> &groups = outcomes->groups;
+  groups.clear();
+  outcomes->order.clear();
+
+  std::map<Move, uint32_t> indices;
+  std::vector<uint32_t> group_of(particles.size());
+  // Weighted sum of each group's scores after the move.
+  std::vector<int64_t> scores;
+  for (size_t i = 0; i < particles.size(); i++) {
+    Board b = particles[i];
+    assert(b.get_piece(move.from.rank, move.from.file).color == our_color);
+    MoveResult move_result = b.apply_move(move);
+
+    if (move_result.capture.piece.type == PieceType::KING) {
+      num_wins += 20 * weights[i];
+    }
+    auto it = indices.find(move_result.move);
+    if (it == indices.end()) {
+      it = indices.emplace(move_result.move, groups.size()).first;
+      groups.push_back(MoveOutcomes::Group{move_result.move, 0, 0, 0, 0});
+      scores.push_back(0);
     }
+    group_of[i] = it->second;
+    groups[it->second].end++;
+    groups[it->second].weight += weights[i];
+    scores[it->second] +=
+        static_cast<int64_t>(b.score(our_color)) * weights[i];
   }
 
-  for (auto &it : result) {
-    std::vector<Board> &it_particles = std::get<2>(it).particles;
-    while (it_particles.size() < particles.size()) {
-      Board b = random_choice(it_particles);
-      it_particles.push_back(b);
+  // Lay the groups out one after another. With a single group, particle(k)
+  // is just k.
+  uint32_t begin = 0;
+  for (MoveOutcomes::Group &group : groups) {
+    uint32_t size = group.end;
+    group.begin = group.end = begin;
+    begin += size;
+  }
+  if (groups.size() > 1) {
+    outcomes->order.resize(particles.size());
+    for (uint32_t i = 0; i < particles.size(); i++) {
+      outcomes->order[groups[group_of[i]].end++] = i;
     }
+  } else if (!groups.empty()) {
+    groups[0].end = particles.size();
+  }
+
+  for (size_t g = 0; g < groups.size(); g++) {
+    groups[g].heuristic = scores[g] /
+                          static_cast<double>(groups[g].weight) / kScoreScale;
+  }
+
+  return static_cast<double>(num_wins) / total_weight();
+}
+
+StateDistribution StateDistribution::outcome(Move move, Color our_color,
+                                             const MoveOutcomes &outcomes,
+                                             size_t group) const {
+  const MoveOutcomes::Group &g = outcomes.groups[group];
+  ParticleAccumulator accumulator;
+  for (uint32_t k = g.begin; k < g.end; k++) {
+    uint32_t i = outcomes.particle(k);
+    Board b = particles[i];
+    b.apply_move(move);
+    accumulator.add(b, weights[i]);
+  }
+  StateDistribution distribution = accumulator.build();
+  distribution.CheckValid(our_color);
+  distribution.resample_to(total_weight());
+  return distribution;
+}
+
+std::vector<std::tuple<int, Capture, StateDistribution>>
+StateDistribution::update_random(Color opponent_color) const {
+  // Every particle picks a uniformly random move, like Board::do_random_move.
+  // A board's weight is split over its moves so each distinct move is only
+  // applied once.
+  auto groups = accumulate_parallel<GroupedAccumulator<Capture>>(
+      particles.size(),
+      [&](size_t begin, size_t end, GroupedAccumulator<Capture> *groups) {
+        MoveList moves;
+        std::vector<int> counts;
+        for (size_t i = begin; i < end; i++) {
+          particles[i].generate_moves(opponent_color, moves);
+          if (moves.empty()) {
+            (*groups)[Capture::NONE].add(particles[i], weights[i]);
+            continue;
+          }
+          split_weight(weights[i], moves.size(), &counts);
+          for (size_t m = 0; m < moves.size(); m++) {
+            if (counts[m] == 0) {
+              continue;
+            }
+            Board b = particles[i];
+            Capture capture = b.apply_move(moves[m]).capture;
+            (*groups)[capture].add(b, counts[m]);
+          }
+        }
+      });
+
+  int total = total_weight();
+  std::vector<std::tuple<int, Capture, StateDistribution>> result;
+  for (size_t i = 0; i < groups.groups.size(); i++) {
+    int weight = groups.groups[i].total_weight();
+    StateDistribution distribution = groups.groups[i].build();
+    distribution.resample_to(total);
+    result.push_back(
+        std::make_tuple(weight, groups.keys[i], std::move(distribution)));
   }
   return result;
 }
 
-std::vector<Move> StateDistribution::get_available_actions(Color color) const {
-  return particles[0].generate_moves(color);
+void StateDistribution::get_available_actions(Color color,
+                                              MoveList &moves) const {
+  particles[0].generate_moves(color, moves);
 }
 
-static bool is_valid(const Board &b, Observation obs) {
-  for (int i = 0; i < 3; i++) {
-    for (int j = 0; j < 3; j++) {
-      if (b.get_piece(obs.origin.rank + i, obs.origin.file + j) !=
-          obs.obs[i][j]) {
-        return false;
-      }
+double StateDistribution::consistent_fraction(const Observation &obs) const {
+  SensedWindow window(obs);
+  int consistent = 0;
+  for (size_t i = 0; i < particles.size(); i++) {
+    if (window.matches(particles[i])) {
+      consistent += weights[i];
     }
   }
-  return true;
+  return static_cast<double>(consistent) / total_weight();
 }
 
 void StateDistribution::observe(Observation obs, Color our_color) {
-  std::vector<Board> result_particles;
-  while (result_particles.size() < particles.size()) {
-    //    ::std::cout << result_particles.size() << std::endl;
-    Board b = random_choice(particles);
-    if (coerce_board(b, obs, our_color)) {
-      if (is_valid(b, obs)) {
-        result_particles.push_back(b);
-      } else {
-        b.debug_print(std::cout);
-        for (int i = 2; i >= 0; --i) {
-          for (int j = 0; j < 3; ++j) {
-            std::cout << obs.obs[i][j] << ", ";
+  int total = total_weight();
+  SensedWindow window(obs);
+
+  // Keep every particle that already agrees with the sense result.
+  std::vector<char> consistent(particles.size());
+  auto result = accumulate_parallel<ParticleAccumulator>(
+      particles.size(),
+      [&](size_t begin, size_t end, ParticleAccumulator *result) {
+        for (size_t i = begin; i < end; i++) {
+          consistent[i] = window.matches(particles[i]);
+          if (consistent[i]) {
+            result->add(particles[i], weights[i]);
           }
-          std::cout << ::std::endl;
         }
-        ::std::cout << "is not valid" << std::endl;
+      });
+
+  // Too few of them to resample from: repair randomly drawn inconsistent
+  // particles to make up the difference.
+  int shortfall =
+      static_cast<int>(kMinConsistentFraction * total) - result.total_weight();
+  if (shortfall > 0) {
+    std::vector<size_t> inconsistent;
+    std::vector<int> inconsistent_weights;
+    for (size_t i = 0; i < particles.size(); i++) {
+      if (!consistent[i]) {
+        inconsistent.push_back(i);
+        inconsistent_weights.push_back(weights[i]);
       }
-    } else {
-      ::std::cout << "could not coerce" << std::endl;
     }
+    std::vector<int> tries(inconsistent.size());
+    std::discrete_distribution<size_t> pick(inconsistent_weights.begin(),
+                                            inconsistent_weights.end());
+    for (int i = 0; i < shortfall; i++) {
+      tries[pick(get_random_engine())]++;
+    }
+
+    result.merge(accumulate_parallel<ParticleAccumulator>(
+        inconsistent.size(),
+        [&](size_t begin, size_t end, ParticleAccumulator *result) {
+          for (size_t k = begin; k < end; k++) {
+            // Coercion is random, so every try starts from a fresh copy.
+            for (int copy = 0; copy < tries[k]; copy++) {
+              Board b = particles[inconsistent[k]];
+              if (coerce_board(b, obs, our_color) && window.matches(b)) {
+                result->add(b, 1);
+              }
+            }
+          }
+        }));
+  }
+
+  if (result.empty()) {
+    // Nothing matches; keep the old beliefs rather than none.
+    return;
   }
-  std::swap(particles, result_particles);
+  *this = result.build();
+  resample_to(total);
 }
 
 void StateDistribution::handle_move_result(Move taken_move, Color our_color,
                                            bool capture,
                                            Position captured_position) {
   CheckValid(our_color);
-  std::vector<Board> result_particles;
-  while (result_particles.size() < particles.size()) {
-    Board b = random_choice(particles);
+  if (taken_move.from == taken_move.to) {
+    return;
+  }
 
-    if (taken_move.from == taken_move.to) {
-      return;
-    }
+  int total = total_weight();
+  auto result = accumulate_parallel<ParticleAccumulator>(
+      particles.size(),
+      [&](size_t begin, size_t end, ParticleAccumulator *result) {
+        auto apply = [&](Board b, int weight) {
+          MoveResult move_result =
+              b.move_piece(taken_move.from, taken_move.to);
+          if (move_result.move.to == taken_move.to) {
+            result->add(b, weight);
+          }
+        };
+        std::vector<int> counts;
 
-    if (capture) {
-      if (b.get_piece(captured_position.rank, captured_position.file).color ==
-          Color::EMPTY) {
-        auto opponent_pieces =
-            b.find_all_valid_color(opponent(our_color), captured_position);
-        Position chosen = random_choice(opponent_pieces);
-        Piece chosen_piece = b.get_piece(chosen.rank, chosen.file);
-        b.set_piece(chosen.rank, chosen.file, Piece::EMPTY);
-        b.set_piece(captured_position.rank, captured_position.file,
-                    chosen_piece);
-      } else if (b.get_piece(captured_position.rank, captured_position.file)
-                     .type == PieceType::KING) {
-        continue;
-      }
-    } else {
-      handle_board_piece_no_obs(
-          b, b.get_piece(taken_move.to.rank, taken_move.to.file), {0, 0},
-          {taken_move.to.rank, taken_move.to.rank});
-    }
+        for (size_t i = begin; i < end; i++) {
+          const Board &board = particles[i];
+          Piece captured = capture ? board.get_piece(captured_position.rank,
+                                                     captured_position.file)
+                                   : Piece::EMPTY;
+          Piece target =
+              board.get_piece(taken_move.to.rank, taken_move.to.file);
 
-    MoveResult result = b.move_piece(taken_move.from, taken_move.to);
-    if (result.move.to == taken_move.to) {
-      result_particles.push_back(b);
-    }
+          if (capture && captured.type == PieceType::KING) {
+            // We'd have won already.
+            continue;
+          } else if (capture && captured.color == Color::EMPTY) {
+            // Some opponent piece must have been there. Split the particles
+            // between the pieces that could have been, as
+            // handle_opponent_move_result does; with none, drop them.
+            auto opponent_pieces = board.find_all_valid_color(
+                opponent(our_color), captured_position);
+            if (opponent_pieces.empty()) {
+              continue;
+            }
+            split_weight(weights[i], opponent_pieces.size(), &counts);
+            for (size_t p = 0; p < opponent_pieces.size(); p++) {
+              if (counts[p] == 0) {
+                continue;
+              }
+              Board b = board;
+              Position chosen = opponent_pieces[p];
+              Piece chosen_piece = b.get_piece(chosen.rank, chosen.file);
+              b.set_piece(chosen.rank, chosen.file, Piece::EMPTY);
+              b.set_piece(captured_position.rank, captured_position.file,
+                          chosen_piece);
+              apply(b, counts[p]);
+            }
+          } else if (!capture && target.color == opponent(our_color)) {
+            // Nothing was captured, so the piece we landed on must be
+            // elsewhere. Split the particles between the squares it could
+            // be on; with none, drop them, and resample from the rest.
+            Bitboard squares = relocation_targets(board, target, taken_move.to,
+                                                  taken_move.to);
+            if (!squares) {
+              continue;
+            }
+            split_weight(weights[i], popcount(squares), &counts);
+            for (size_t k = 0; squares; k++) {
+              int square = pop_lsb(squares);
+              if (counts[k] == 0) {
+                continue;
+              }
+              Board b = board;
+              b.set_piece(square / 8, square % 8, target);
+              b.set_piece(taken_move.to.rank, taken_move.to.file,
+                          Piece::EMPTY);
+              apply(b, counts[k]);
+            }
+          } else {
+            apply(board, weights[i]);
+          }
+        }
+      });
+  if (!result.empty()) {
+    *this = result.build();
+    resample_to(total);
   }
-  std::swap(particles, result_particles);
   CheckValid(our_color);
 }
 
@@ -345,37 +732,24 @@ bool StateDistribution::coerce_board(Board &board, Observation obs,
           if (obs_piece != Piece::EMPTY) {
             if (board_piece == Piece::EMPTY) {
               // the board is missing a piece
-              std::cout << "obs_piece_no_board" << std::endl;
-              bool res = handle_obs_piece_no_board(board, obs_piece, obs_pos,
-                                                   obs.origin);
-              if (!res) {
-                std::cout << "obs_piece_no_board" << std::endl;
+              if (!handle_obs_piece_no_board(board, obs_piece, obs_pos,
+                                             obs.origin)) {
                 return false;
               }
             } else {
               // the observation and board mismatch
               bool res = handle_board_piece_no_obs(board, board_piece, obs_pos,
                                                    obs.origin);
-              std::cout << "temp handle_board_piece_no_obs" << std::endl;
-              if (!res) {
-                std::cout << "temp handle_board_piece_no_obs" << std::endl;
-              }
               res &= handle_obs_piece_no_board(board, obs_piece, obs_pos,
                                                obs.origin);
-              std::cout << "temp handle_obs_piece_no_board" << std::endl;
               if (!res) {
-                std::cout << "temp handle_obs_piece_no_board" << std::endl;
                 return false;
               }
             }
           } else {
             // the observation is empty but we expected something
-            std::cout << "handle_board_piece_no_obs" << std::endl;
-            std::cout << board_piece << " " << obs_pos << std::endl;
-            bool res = handle_board_piece_no_obs(board, board_piece, obs_pos,
-                                                 obs.origin);
-            if (!res) {
-              std::cout << "handle_board_piece_no_obs" << std::endl;
+            if (!handle_board_piece_no_obs(board, board_piece, obs_pos,
+                                           obs.origin)) {
               return false;
             }
           }
@@ -389,68 +763,90 @@ bool StateDistribution::coerce_board(Board &board, Observation obs,
   return true;
 }
 
-StateDistribution StateDistribution::subsample(size_t num) {
-  std::vector<Board> result;
-  for (size_t i = 0; i < num; i++) {
-    result.push_back(random_choice(particles));
+StateDistribution StateDistribution::subsample(size_t num) const {
+  std::vector<int> counts;
+  draw(num, &counts);
+
+  std::vector<Board> boards;
+  std::vector<int> boards_weights;
+  for (size_t i = 0; i < particles.size(); i++) {
+    if (counts[i] > 0) {
+      boards.push_back(particles[i]);
+      boards_weights.push_back(counts[i]);
+    }
   }
-  return StateDistribution(std::move(result));
+  return StateDistribution(std::move(boards), std::move(boards_weights));
 }
 
 void StateDistribution::reinitialize(Board board) {
-  std::vector<Board> new_particles(kNumParticles, board);
-  std::swap(new_particles, particles);
+  particles = {board};
+  weights = {static_cast<int>(kNumParticles)};
 }
 
 void StateDistribution::entropy(std::array<std::array<double, 8>, 8> &out,
                                 Color our_color) const {
-  std::array<std::array<std::array<int, 8>, 8>, 7> piece_counts;
-
-  for (auto &b : piece_counts) {
-    for (auto &r : b) {
-      r.fill(0);
-    }
-  }
+  // Particle weight with each kind of opponent piece on each square, indexed
+  // by PieceType. EMPTY counts empty squares.
+  std::array<std::array<int, 64>, 7> piece_counts{};
+  // Weight with one of our pieces on each square, which doesn't count.
+  std::array<int, 64> our_counts{};
 
-  for (const Board &p : particles) {
-    for (int i = 0; i < 8; i++) {
-      for (int j = 0; j < 8; j++) {
-        if (p.get_piece(i, j).color != our_color) {
-          int key = static_cast<int>(p.get_piece(i, j).type);
-          piece_counts[key][i][j]++;
-        }
+  Color their_color = opponent(our_color);
+  for (size_t k = 0; k < particles.size(); k++) {
+    const Board &p = particles[k];
+    int weight = weights[k];
+    for (int type = 1; type < 7; type++) {
+      Bitboard b = p.pieces(their_color, static_cast<PieceType>(type));
+      while (b) {
+        piece_counts[type][pop_lsb(b)] += weight;
       }
     }
+    Bitboard b = p.occupancy(our_color);
+    while (b) {
+      our_counts[pop_lsb(b)] += weight;
+    }
   }
 
-  for (auto &count : piece_counts) {
-    for (int i = 0; i < 8; i++) {
-      for (int j = 0; j < 8; j++) {
-        if (count[i][j] != 0) {
-          double prob = static_cast<double>(count[i][j]) / particles.size();
-          out[i][j] -= prob * std::log2(prob);
-        }
-      }
+  add_square_entropies(piece_counts, our_counts, total_weight(), out);
+}
+
+double StateDistribution::observation_entropy(Position origin) const {
+  Bitboard window = window_mask(origin);
+
+  // Group the particles by what they'd show, hashing the window's squares.
+  // Kings are the occupied squares no other type claims.
+  std::unordered_map<uint64_t, int> shown;
+  for (size_t k = 0; k < particles.size(); k++) {
+    const Board &b = particles[k];
+    uint64_t signature = 0;
+    for (PieceType type : {PieceType::PAWN, PieceType::QUEEN, PieceType::ROOK,
+                           PieceType::KNIGHT, PieceType::BISHOP}) {
+      signature = mix64(signature ^ (b.pieces(type) & window));
     }
+    signature = mix64(signature ^ (b.occupancy(Color::WHITE) & window));
+    signature = mix64(signature ^ (b.occupancy(Color::BLACK) & window));
+    shown[signature] += weights[k];
   }
+  return outcome_entropy(shown, total_weight());
 }
 
 double StateDistribution::square_entropy(Position position) const {
   std::map<Piece, int> piece_counts;
-  for (const Board &p : particles) {
-    Piece piece = p.get_piece(position.rank, position.file);
+  for (size_t i = 0; i < particles.size(); i++) {
+    Piece piece = particles[i].get_piece(position.rank, position.file);
     auto it = piece_counts.find(piece);
     if (it == piece_counts.end()) {
-      piece_counts.insert({piece, 1});
+      piece_counts.insert({piece, weights[i]});
     } else {
-      it->second++;
+      it->second += weights[i];
     }
   }
 
+  int total = total_weight();
   double entropy = 0.0;
   for (auto it : piece_counts) {
     if (it.second > 0) {
-      double prob = static_cast<double>(it.second) / particles.size();
+      double prob = static_cast<double>(it.second) / total;
       entropy -= prob * std::log2(prob);
     }
   }
@@ -461,43 +857,187 @@ void StateDistribution::handle_opponent_move_result(bool captured_piece,
                                                     Position capture,
                                                     Color opponent_color) {
   CheckValid(opponent(opponent_color));
-  std::vector<Board> new_particles;
-  while (new_particles.size() < particles.size()) {
-    Board b = random_choice(particles);
-    if (!captured_piece) {
-      MoveResult result = b.do_random_move(opponent_color);
-      if (result.capture == Capture::NONE) {
-        new_particles.push_back(b);
-      }
-    } else {
-      auto opponent_pieces = b.find_all_valid_color(opponent_color, capture);
-      Position chosen = random_choice(opponent_pieces);
-      Piece chosen_piece = b.get_piece(chosen.rank, chosen.file);
-      b.set_piece(chosen.rank, chosen.file, Piece::EMPTY);
-      b.set_piece(capture.rank, capture.file, chosen_piece);
-      new_particles.push_back(b);
-    }
+  int total = total_weight();
+  auto result = accumulate_parallel<ParticleAccumulator>(
+      particles.size(),
+      [&](size_t begin, size_t end, ParticleAccumulator *result) {
+        MoveList moves;
+        std::vector<int> counts;
+        for (size_t i = begin; i < end; i++) {
+          const Board &board = particles[i];
+          if (!captured_piece) {
+            // Each particle makes a random move; keep the ones that captured
+            // nothing.
+            board.generate_moves(opponent_color, moves);
+            if (moves.empty()) {
+              result->add(board, weights[i]);
+              continue;
+            }
+            split_weight(weights[i], moves.size(), &counts);
+            for (size_t m = 0; m < moves.size(); m++) {
+              if (counts[m] == 0) {
+                continue;
+              }
+              Board b = board;
+              MoveResult move_result = b.apply_move(moves[m]);
+              if (move_result.capture == Capture::NONE) {
+                result->add(b, counts[m]);
+              }
+            }
+          } else {
+            // Each particle moves a random opponent piece onto the capture
+            // square.
+            auto opponent_pieces =
+                board.find_all_valid_color(opponent_color, capture);
+            if (opponent_pieces.empty()) {
+              continue;
+            }
+            split_weight(weights[i], opponent_pieces.size(), &counts);
+            for (size_t p = 0; p < opponent_pieces.size(); p++) {
+              if (counts[p] == 0) {
+                continue;
+              }
+              Board b = board;
+              Position chosen = opponent_pieces[p];
+              Piece chosen_piece = b.get_piece(chosen.rank, chosen.file);
+              b.set_piece(chosen.rank, chosen.file, Piece::EMPTY);
+              b.set_piece(capture.rank, capture.file, chosen_piece);
+              result->add(b, counts[p]);
+            }
+          }
+        }
+      });
+  if (!result.empty()) {
+    *this = result.build();
+    resample_to(total);
   }
-  std::swap(particles, new_particles);
   CheckValid(opponent(opponent_color));
 }
 
-void StateDistribution::CheckValid(Color color) const {
-  size_t z = 0;
-  for (Board b : particles) {
-    for (int i = 0; i < 8; ++i) {
-      for (int j = 0; j < 8; ++j) {
-        if (b.get_piece(i, j).color == color) {
-          if (b.get_piece(i, j) != particles.at(0).get_piece(i, j)) {
-            assert(false);
-          }
-        }
+void StateDistribution::check_pieces(Color color) const {
+  if (particles.empty()) {
+    return;
+  }
+  // Sampled checks look at about kSampledChecks particles, spread evenly so
+  // the random streams aren't touched.
+  size_t step = CHESS_CHECK_LEVEL > 1
+                    ? 1
+                    : std::max<size_t>(1, particles.size() / kSampledChecks);
+  const Board &first = particles[0];
+  for (size_t i = step; i < particles.size(); i += step) {
+    const Board &b = particles[i];
+    bool same = b.occupancy(color) == first.occupancy(color);
+    for (PieceType type : {PieceType::PAWN, PieceType::QUEEN, PieceType::ROOK,
+                           PieceType::KNIGHT, PieceType::BISHOP}) {
+      same = same && b.pieces(color, type) == first.pieces(color, type);
+    }
+    if (!same) {
+      CHESS_LOG(ERROR) << "Particle " << i << " disagrees on our pieces";
+      Logger::global().flush();
+      std::abort();
+    }
+  }
+}
+
+ColumnarDistribution::ColumnarDistribution(
+    const StateDistribution &distribution)
+    : weights(distribution.weights) {
+  boards.reserve(distribution.particles.size());
+  for (const Board &b : distribution.particles) {
+    boards.push_back(b);
+  }
+}
+
+StateDistribution ColumnarDistribution::to_distribution() const {
+  std::vector<Board> particles;
+  particles.reserve(boards.size());
+  for (size_t i = 0; i < boards.size(); i++) {
+    particles.push_back(boards.get(i));
+  }
+  std::vector<int> particle_weights = weights;
+  return StateDistribution(std::move(particles), std::move(particle_weights));
+}
+
+int ColumnarDistribution::total_weight() const {
+  int total = 0;
+  for (int w : weights) {
+    total += w;
+  }
+  return total;
+}
+
+void ColumnarDistribution::entropy(std::array<std::array<double, 8>, 8> &out,
+                                   Color our_color) const {
+  std::array<std::array<int, 64>, 7> piece_counts{};
+  std::array<int, 64> our_counts{};
+
+  // Add the weight of each board to the squares of column[k] & mask[k].
+  auto count = [&](const std::vector<Bitboard> &column,
+                   const std::vector<Bitboard> &mask,
+                   std::array<int, 64> &counts) {
+    for (size_t k = 0; k < column.size(); k++) {
+      Bitboard b = column[k] & mask[k];
+      while (b) {
+        counts[pop_lsb(b)] += weights[k];
       }
     }
-    z++;
+  };
+
+  const std::vector<Bitboard> &theirs =
+      boards.color_column(opponent(our_color));
+  // Their kings are what's left once every other type is taken out.
+  std::vector<Bitboard> kings = theirs;
+  for (PieceType type : {PieceType::PAWN, PieceType::QUEEN, PieceType::ROOK,
+                         PieceType::KNIGHT, PieceType::BISHOP}) {
+    const std::vector<Bitboard> &column = boards.type_column(type);
+    for (size_t k = 0; k < kings.size(); k++) {
+      kings[k] &= ~column[k];
+    }
+    count(column, theirs, piece_counts[static_cast<int>(type)]);
   }
+  count(kings, theirs, piece_counts[static_cast<int>(PieceType::KING)]);
+  const std::vector<Bitboard> &ours = boards.color_column(our_color);
+  count(ours, ours, our_counts);
+
+  add_square_entropies(piece_counts, our_counts, total_weight(), out);
+}
+
+double ColumnarDistribution::observation_entropy(Position origin) const {
+  Bitboard window = window_mask(origin);
+  // The same signatures as StateDistribution::observation_entropy, built a
+  // column at a time.
+  std::vector<uint64_t> signatures(boards.size(), 0);
+  auto fold = [&](const std::vector<Bitboard> &column) {
+    for (size_t k = 0; k < column.size(); k++) {
+      signatures[k] = mix64(signatures[k] ^ (column[k] & window));
+    }
+  };
+  for (PieceType type : {PieceType::PAWN, PieceType::QUEEN, PieceType::ROOK,
+                         PieceType::KNIGHT, PieceType::BISHOP}) {
+    fold(boards.type_column(type));
+  }
+  fold(boards.color_column(Color::WHITE));
+  fold(boards.color_column(Color::BLACK));
+
+  std::unordered_map<uint64_t, int> shown;
+  for (size_t k = 0; k < signatures.size(); k++) {
+    shown[signatures[k]] += weights[k];
+  }
+  return outcome_entropy(shown, total_weight());
+}
+
+double ColumnarDistribution::consistent_fraction(
+    const Observation &obs) const {
+  std::vector<Bitboard> mismatched;
+  SensedWindow(obs).find_mismatches(boards, &mismatched);
+  int consistent = 0;
+  for (size_t k = 0; k < mismatched.size(); k++) {
+    if (mismatched[k] == 0) {
+      consistent += weights[k];
+    }
+  }
+  return static_cast<double>(consistent) / total_weight();
 }
 
 }  // namespace agent
 }  // namespace chess
-
@@ -5,34 +5,92 @@
 
 #include "chess.h"
 
+// How thoroughly StateDistribution::CheckValid looks: 0 compiles it out, 1
+// checks a handful of particles and 2 checks every one. Off by default in
+// optimized (NDEBUG) builds.
+#ifndef CHESS_CHECK_LEVEL
+#ifdef NDEBUG
+#define CHESS_CHECK_LEVEL 0
+#else
+#define CHESS_CHECK_LEVEL 2
+#endif
+#endif
+
 namespace chess {
 
 namespace agent {
 
 constexpr size_t kNumParticlesRollout = 100;
 constexpr size_t kNumParticles = 10000;
+// If fewer particles than this agree with a sense result, observe repairs
+// inconsistent ones until this many do.
+constexpr double kMinConsistentFraction = 0.25;
+
+// What one of our moves did across a distribution's particles, without the
+// resulting boards: particles it affected the same way form a group, and a
+// group only refers to its particles by index. Build a group's distribution
+// with StateDistribution::outcome, from the same distribution.
+struct MoveOutcomes {
+  struct Group {
+    // What our move actually did in these particles.
+    Move taken_move;
+    // The group's particles are particle(begin) to particle(end - 1).
+    uint32_t begin;
+    uint32_t end;
+    // Particles the group stands for.
+    int weight;
+    // heuristic_value of the group's particles after the move.
+    double heuristic;
+  };
+
+  // Index of the k-th particle, in group order.
+  uint32_t particle(uint32_t k) const { return order.empty() ? k : order[k]; }
+
+  std::vector<Group> groups;
+  // Particle indices, grouped. Left empty if there is only one group.
+  std::vector<uint32_t> order;
+};
 
+// A distribution over boards, stored as unique boards with integer weights.
+// A weight is the number of particles that board stands for, so a
+// distribution of 10000 identical boards is a single entry.
 class StateDistribution {
  public:
-  StateDistribution(std::vector<Board> &&boards)
-      : particles(std::move(boards)) {}
+  // One particle per board; duplicates are merged.
+  StateDistribution(std::vector<Board> &&boards);
+  // `boards` must already be unique, with weights[i] particles on boards[i].
+  StateDistribution(std::vector<Board> &&boards, std::vector<int> &&weights)
+      : particles(std::move(boards)), weights(std::move(weights)) {}
+  StateDistribution(const Board &board, int weight)
+      : particles{board}, weights{weight} {}
   StateDistribution(StateDistribution &&) = default;
   StateDistribution(const StateDistribution &) = default;
+  StateDistribution &operator=(StateDistribution &&) = default;
+  StateDistribution &operator=(const StateDistribution &) = default;
 
   Board sample() const;
 
   // Move each particle randomly, splitting into equivalence classes by captured
-  // piece Returns [(weight, capture, distribution)]
+  // piece. Returns [(weight, capture, distribution)], where weight is the
+  // number of particles in the class and each distribution is topped back up
+  // to total_weight().
   std::vector<std::tuple<int, Capture, StateDistribution>> update_random(
       Color opponent_color) const;
 
-  // Update the board and return the fraction of games won by that move.
-  std::tuple<double, std::vector<std::tuple<int, Move, StateDistribution>>>
-  update(Move move, Color our_color) const;
+  // Group the particles by what `move` does in them, and return the fraction
+  // of games won by that move.
+  double update(Move move, Color our_color, MoveOutcomes *outcomes) const;
+
+  // The particles in one group from update(move, ...), with the move applied
+  // and topped back up to total_weight().
+  StateDistribution outcome(Move move, Color our_color,
+                            const MoveOutcomes &outcomes, size_t group) const;
 
+  // The mean Board::score for `color` over the particles, scaled to about
+  // [-1, 1].
   double heuristic_value(Color color) const;
 
-  std::vector<Move> get_available_actions(Color color) const;
+  void get_available_actions(Color color, MoveList &moves) const;
 
   // Handle our observation
   void observe(Observation obs, Color our_color);
@@ -45,7 +103,7 @@ class StateDistribution {
   void handle_opponent_move_result(bool captured_piece, Position capture,
                                    Color opponent_color);
 
-  StateDistribution subsample(size_t num);
+  StateDistribution subsample(size_t num) const;
 
   void reinitialize(Board board);
 
@@ -53,17 +111,73 @@ class StateDistribution {
                Color our_color) const;
   double square_entropy(Position position) const;
 
-  void CheckValid(Color color) const;
+  // The entropy of what sensing the 3x3 window with top-left `origin` would
+  // show. Particles are only told apart by what they show, so this is also
+  // the expected drop in the entropy of the particles from sensing there.
+  double observation_entropy(Position origin) const;
+
+  // Abort unless every particle agrees with the first on where `color`'s
+  // pieces are. See CHESS_CHECK_LEVEL.
+  void CheckValid(Color color) const {
+#if CHESS_CHECK_LEVEL > 0
+    check_pieces(color);
+#endif
+  }
+
+  // The fraction of particles that match `obs` on every sensed square.
+  double consistent_fraction(const Observation &obs) const;
 
+  // The number of particles represented: the sum of `weights`.
+  int total_weight() const;
+
+  // Unique boards, and how many particles each stands for.
   std::vector<Board> particles;
+  std::vector<int> weights;
 
  private:
+  // CheckValid's work, comparing bitboards.
+  void check_pieces(Color color) const;
+
+  // Index of a particle drawn in proportion to weight.
+  size_t sample_index() const;
+
+  // Draw `num` particles in proportion to weight. counts[i] is set to the
+  // number of times particles[i] was drawn.
+  void draw(int num, std::vector<int> *counts) const;
+
+  // Grow the weights, in proportion to their current values, until they add
+  // up to `total`. Keeps the particle count steady after filtering.
+  void resample_to(int total);
+
   // Move one piece of the given color to some other free spot.
   static Board mutate_board(Board board, Color color);
 
   static bool coerce_board(Board &board, Observation obs, Color color);
 };
 
+// A StateDistribution's particles stored column by column (see BoardColumns),
+// for passes that look at the same squares of every particle: per-square
+// histograms and sense window tests. Worth building when several such passes
+// run over the same particles, as when choosing where to sense.
+class ColumnarDistribution {
+ public:
+  explicit ColumnarDistribution(const StateDistribution &distribution);
+
+  StateDistribution to_distribution() const;
+
+  // As the StateDistribution methods of the same names, with the same
+  // results.
+  void entropy(std::array<std::array<double, 8>, 8> &out,
+               Color our_color) const;
+  double observation_entropy(Position origin) const;
+  double consistent_fraction(const Observation &obs) const;
+  int total_weight() const;
+
+  // Unique boards, and how many particles each stands for.
+  BoardColumns boards;
+  std::vector<int> weights;
+};
+
 }  // namespace agent
 
 }  // namespace chess
@@ -0,0 +1,67 @@
+#include "perft.h"
+
+#include <cassert>
+
+#include "thread_pool.h"
+
+namespace chess {
+
+uint64_t perft(const Board &board, Color color, int depth, bool bulk) {
+  if (depth == 0) {
+    return 1;
+  }
+  MoveList moves;
+  board.generate_moves(color, moves);
+  if (bulk && depth == 1) {
+    return moves.size();
+  }
+
+  uint64_t nodes = 0;
+  for (Move move : moves) {
+    Board after = board;
+    MoveResult result = after.apply_move(move);
+    if (depth == 1) {
+      nodes++;
+    } else if (result.capture.piece.type != PieceType::KING) {
+      nodes += perft(after, opponent(color), depth - 1, bulk);
+    }
+  }
+  return nodes;
+}
+
+std::vector<std::pair<Move, uint64_t>> perft_divide(const Board &board,
+                                                    Color color, int depth,
+                                                    bool bulk) {
+  assert(depth >= 1);
+  std::vector<Move> moves = board.generate_moves(color);
+  std::vector<std::pair<Move, uint64_t>> result(moves.size());
+  ThreadPool::global().parallel_for(
+      moves.size(), 1, [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          Board after = board;
+          MoveResult move_result = after.apply_move(moves[i]);
+          uint64_t nodes = 0;
+          if (depth == 1) {
+            nodes = 1;
+          } else if (move_result.capture.piece.type != PieceType::KING) {
+            nodes = perft(after, opponent(color), depth - 1, bulk);
+          }
+          result[i] = std::make_pair(moves[i], nodes);
+        }
+      });
+  return result;
+}
+
+uint64_t perft_parallel(const Board &board, Color color, int depth,
+                        bool bulk) {
+  if (depth == 0) {
+    return 1;
+  }
+  uint64_t nodes = 0;
+  for (auto &m : perft_divide(board, color, depth, bulk)) {
+    nodes += m.second;
+  }
+  return nodes;
+}
+
+}  // namespace chess
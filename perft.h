@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "chess.h"
+
+namespace chess {
+
+// Move generation counts ("perft") under the rules Board implements: there is
+// no check, moves that end up doing nothing (a pawn capture onto an empty
+// square, say) still count, and capturing a king ends the game, so nothing is
+// counted below that move. Passing isn't a generated move and isn't counted.
+
+// The number of move sequences `depth` plies long from `board`, with `color`
+// to move. With `bulk`, the last ply is counted from the move list without
+// applying its moves; the counts are the same either way.
+uint64_t perft(const Board &board, Color color, int depth, bool bulk = true);
+
+// perft below each of `color`'s moves, in generation order, with the root
+// moves split over the global thread pool. `depth` counts the root move, and
+// must be at least 1.
+std::vector<std::pair<Move, uint64_t>> perft_divide(const Board &board,
+                                                    Color color, int depth,
+                                                    bool bulk = true);
+
+// perft, split at the root as perft_divide.
+uint64_t perft_parallel(const Board &board, Color color, int depth,
+                        bool bulk = true);
+
+}  // namespace chess
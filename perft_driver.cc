@@ -0,0 +1,68 @@
+// Counts move sequences from the starting position to each depth, and how fast.
+//
+//   perft_driver [--depth=N] [--threads=N] [--no_bulk] [--divide]
+//
+// --threads=0 uses one thread per core. --divide also prints the count below
+// each root move at the final depth.
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "chess.h"
+#include "perft.h"
+#include "thread_pool.h"
+
+namespace {
+
+// The value of `--name=value` if `arg` is that flag.
+const char *flag_value(const char *arg, const char *name) {
+  size_t length = std::strlen(name);
+  if (std::strncmp(arg, name, length) == 0 && arg[length] == '=') {
+    return arg + length + 1;
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int depth = 5;
+  int threads = 1;
+  bool bulk = true;
+  bool divide = false;
+  for (int i = 1; i < argc; i++) {
+    if (const char *value = flag_value(argv[i], "--depth")) {
+      depth = std::atoi(value);
+    } else if (const char *value = flag_value(argv[i], "--threads")) {
+      threads = std::atoi(value);
+    } else if (std::strcmp(argv[i], "--no_bulk") == 0) {
+      bulk = false;
+    } else if (std::strcmp(argv[i], "--divide") == 0) {
+      divide = true;
+    } else {
+      std::cerr << "Unknown argument " << argv[i] << std::endl;
+      return 1;
+    }
+  }
+  chess::ThreadPool::global().resize(threads);
+
+  chess::Board board = chess::Board::initial_board();
+  for (int d = 1; d <= depth; d++) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t nodes = chess::perft_parallel(board, chess::Color::WHITE, d, bulk);
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    std::cout << "depth " << d << ": " << nodes << " nodes in " << seconds
+              << " s (" << static_cast<uint64_t>(nodes / seconds)
+              << " nodes/s)" << std::endl;
+  }
+
+  if (divide) {
+    for (auto &m : chess::perft_divide(board, chess::Color::WHITE, depth, bulk)) {
+      std::cout << m.first << ": " << m.second << std::endl;
+    }
+  }
+  return 0;
+}
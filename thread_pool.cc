@@ -0,0 +1,113 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+#include "util.h"
+
+namespace chess {
+
+ThreadPool::ThreadPool(int num_threads) { start(num_threads); }
+
+ThreadPool::~ThreadPool() { stop(); }
+
+ThreadPool &ThreadPool::global() {
+  static ThreadPool pool;
+  return pool;
+}
+
+void ThreadPool::resize(int num_threads) {
+  std::lock_guard<std::mutex> running(run_mutex);
+  stop();
+  start(num_threads);
+}
+
+void ThreadPool::start(int num_threads) {
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  stopping = false;
+  // No loop can start until we return, so every worker begins from the
+  // current generation and only wakes for the next one.
+  for (int i = 1; i < num_threads; i++) {
+    workers.emplace_back(&ThreadPool::worker_loop, this, generation);
+  }
+}
+
+void ThreadPool::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  workers.clear();
+}
+
+size_t ThreadPool::num_chunks(size_t n, size_t min_chunk) const {
+  size_t chunks = n / std::max<size_t>(min_chunk, 1);
+  return std::max<size_t>(1, std::min<size_t>(chunks, size()));
+}
+
+void ThreadPool::parallel_for(size_t n, size_t min_chunk, const ChunkFn &fn) {
+  size_t chunks = num_chunks(n, min_chunk);
+  if (chunks == 1) {
+    fn(0, 0, n);
+    return;
+  }
+
+  Job new_job{&fn, n, chunks, get_random_engine()()};
+  std::unique_lock<std::mutex> running(run_mutex, std::try_to_lock);
+  if (!running.owns_lock()) {
+    for (size_t chunk = 0; chunk < chunks; chunk++) {
+      run_chunk(new_job, chunk);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = new_job;
+    next_chunk = 0;
+    active = static_cast<int>(workers.size());
+    generation++;
+  }
+  wake.notify_all();
+  run_chunks();
+
+  // Workers may still hold a pointer to `fn`, even with no chunks left.
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [this] { return active == 0; });
+}
+
+void ThreadPool::worker_loop(size_t seen) {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    wake.wait(lock, [&] { return stopping || generation != seen; });
+    if (stopping) {
+      return;
+    }
+    seen = generation;
+    lock.unlock();
+    run_chunks();
+    lock.lock();
+    if (--active == 0) {
+      done.notify_all();
+    }
+  }
+}
+
+void ThreadPool::run_chunks() {
+  for (size_t chunk = next_chunk++; chunk < job.chunks; chunk = next_chunk++) {
+    run_chunk(job, chunk);
+  }
+}
+
+void ThreadPool::run_chunk(const Job &job, size_t chunk) {
+  ScopedRandomStream stream(job.seed, chunk);
+  (*job.fn)(chunk, job.n * chunk / job.chunks,
+            job.n * (chunk + 1) / job.chunks);
+}
+
+}  // namespace chess
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace chess {
+
+// A fixed set of worker threads that split a loop into contiguous chunks.
+//
+// Chunk boundaries depend only on the loop size and the number of threads, and
+// each chunk draws from its own random stream seeded off the calling thread's
+// engine, so a loop gives the same results for a given thread count no matter
+// how the chunks are scheduled.
+class ThreadPool {
+ public:
+  using ChunkFn = std::function<void(size_t chunk, size_t begin, size_t end)>;
+
+  // `num_threads` counts the calling thread; 0 means one per core.
+  explicit ThreadPool(int num_threads = 1);
+  ~ThreadPool();
+
+  // The pool used by the particle filter. Starts out single threaded.
+  static ThreadPool &global();
+
+  int size() const { return static_cast<int>(workers.size()) + 1; }
+
+  // Waits for any loop in progress first.
+  void resize(int num_threads);
+
+  // The number of chunks parallel_for splits `n` items into. Chunks hold at
+  // least `min_chunk` items, unless there's only one.
+  size_t num_chunks(size_t n, size_t min_chunk) const;
+
+  // Call fn(chunk, begin, end) for every chunk of [0, n) and wait for all of
+  // them. A single chunk runs inline on the caller's random stream. If the
+  // pool is already running a loop (e.g. a nested call), the chunks run one
+  // after another on this thread, with the same streams.
+  void parallel_for(size_t n, size_t min_chunk, const ChunkFn &fn);
+
+ private:
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  struct Job {
+    const ChunkFn *fn;
+    size_t n;
+    size_t chunks;
+    uint64_t seed;
+  };
+
+  void start(int num_threads);
+  void stop();
+  // Runs jobs from generations after `seen`.
+  void worker_loop(size_t seen);
+
+  // Claim and run chunks of the current job until there are none left.
+  void run_chunks();
+  static void run_chunk(const Job &job, size_t chunk);
+
+  std::vector<std::thread> workers;
+
+  // Held for the duration of a parallel_for or resize.
+  std::mutex run_mutex;
+
+  // Guards everything below.
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  Job job;
+  size_t generation = 0;
+  int active = 0;
+  bool stopping = false;
+  std::atomic<size_t> next_chunk{0};
+};
+
+}  // namespace chess
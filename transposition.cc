@@ -0,0 +1,82 @@
+#include "transposition.h"
+
+namespace chess {
+
+namespace agent {
+
+TranspositionTable::TranspositionTable(size_t bytes)
+    : locks(new std::mutex[kLockStripes]) {
+  num_buckets = 1;
+  while (num_buckets * 2 * kWays * sizeof(Entry) <= bytes) {
+    num_buckets *= 2;
+  }
+  entries.reset(new Entry[num_buckets * kWays]);
+}
+
+void TranspositionTable::new_generation() { generation++; }
+
+bool TranspositionTable::lookup(uint64_t key, Entry *entry) {
+  key = stored_key(key);
+  size_t index = bucket_index(key);
+  std::lock_guard<std::mutex> lock(lock_for(index));
+  Entry *entries = bucket(index);
+  for (size_t i = 0; i < kWays; i++) {
+    if (entries[i].key == key) {
+      entries[i].generation = generation;
+      *entry = entries[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+void TranspositionTable::store(uint64_t key, double reward) {
+  key = stored_key(key);
+  size_t index = bucket_index(key);
+  std::lock_guard<std::mutex> lock(lock_for(index));
+  find_or_replace(bucket(index), key, reward);
+}
+
+void TranspositionTable::add_sample(uint64_t key, double reward,
+                                    double value) {
+  key = stored_key(key);
+  size_t index = bucket_index(key);
+  std::lock_guard<std::mutex> lock(lock_for(index));
+  Entry &entry = find_or_replace(bucket(index), key, reward);
+  entry.count++;
+  entry.value += (value - entry.value) / entry.count;
+}
+
+TranspositionTable::Entry &TranspositionTable::find_or_replace(
+    Entry *entries, uint64_t key, double reward) {
+  for (size_t i = 0; i < kWays; i++) {
+    if (entries[i].key == key) {
+      entries[i].generation = generation;
+      return entries[i];
+    }
+  }
+
+  // Prefer an empty entry, then the one last used longest ago, then the one
+  // with the fewest simulations. Ages rather than generations, since those
+  // wrap around.
+  Entry *victim = &entries[0];
+  for (size_t i = 1; i < kWays && victim->key != 0; i++) {
+    Entry &entry = entries[i];
+    uint16_t age = generation - entry.generation;
+    uint16_t victim_age = generation - victim->generation;
+    if (entry.key == 0 || age > victim_age ||
+        (age == victim_age && entry.count < victim->count)) {
+      victim = &entry;
+    }
+  }
+
+  *victim = Entry();
+  victim->key = key;
+  victim->reward = reward;
+  victim->generation = generation;
+  return *victim;
+}
+
+}  // namespace agent
+
+}  // namespace chess
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace chess {
+
+namespace agent {
+
+constexpr size_t kTranspositionTableBytes = 64 << 20;
+
+// UCT statistics for (position of our pieces, move) pairs, shared by every
+// node that reaches the same position of ours by a different route.
+//
+// A fixed-size, two-way set-associative table, safe to use from several
+// threads. When a bucket is full the entry from the oldest search goes first,
+// then the one with the fewest simulations.
+class TranspositionTable {
+ public:
+  struct Entry {
+    uint64_t key = 0;
+    // The immediate reward for the move.
+    double reward = 0;
+    // The mean of `count` simulated values.
+    double value = 0;
+    int count = 0;
+    uint16_t generation = 0;
+  };
+
+  explicit TranspositionTable(size_t bytes = kTranspositionTableBytes);
+
+  // Call at the start of each search. Older entries are replaced first.
+  void new_generation();
+
+  // Copy out the entry for `key`, if there is one.
+  bool lookup(uint64_t key, Entry *entry);
+
+  // Record the immediate reward for `key`, making an entry if needed.
+  void store(uint64_t key, double reward);
+
+  // Add one simulated value for `key`.
+  void add_sample(uint64_t key, double reward, double value);
+
+ private:
+  static constexpr size_t kWays = 2;
+  static constexpr size_t kLockStripes = 1024;
+
+  TranspositionTable(const TranspositionTable &) = delete;
+  TranspositionTable &operator=(const TranspositionTable &) = delete;
+
+  // Keys are stored with the low bit set, so 0 marks an empty entry.
+  static uint64_t stored_key(uint64_t key) { return key | 1; }
+  size_t bucket_index(uint64_t key) const { return (key >> 1) % num_buckets; }
+  Entry *bucket(size_t index) { return &entries[index * kWays]; }
+  std::mutex &lock_for(size_t index) { return locks[index % kLockStripes]; }
+
+  // The entry for `key` in the given bucket, replacing one if it isn't there.
+  // The bucket's lock must be held.
+  Entry &find_or_replace(Entry *bucket, uint64_t key, double reward);
+
+  std::unique_ptr<Entry[]> entries;
+  size_t num_buckets;
+  std::unique_ptr<std::mutex[]> locks;
+  uint16_t generation = 0;
+};
+
+}  // namespace agent
+
+}  // namespace chess
@@ -1,34 +1,270 @@
 #include "uct.h"
 
 #include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <limits>
 #include <map>
 #include <random>
 #include <tuple>
 
+#include "logging.h"
+#include "thread_pool.h"
 #include "util.h"
 
 namespace chess {
 
 namespace agent {
 
-std::mt19937 &get_random_engine() {
-  static std::mt19937 mt;
-  return mt;
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Simulate from `root` until `deadline`, or until the most visited entry is
+// settled. `threads` is the number of threads searching the same root.
+void simulate_until(OurUctNode &root, Clock::time_point deadline, int depth,
+                    int threads) {
+  if (root.entries().empty()) {
+    return;
+  }
+  Clock::time_point start = Clock::now();
+  for (int iters = 1;; iters++) {
+    root.simulate(depth);
+
+    Clock::time_point now = Clock::now();
+    Clock::duration per_iter =
+        std::max<Clock::duration>((now - start) / iters, Clock::duration(1));
+    // Don't start an iteration we don't expect to finish in time.
+    if (now + per_iter >= deadline) {
+      return;
+    }
+    long long remaining = (deadline - now) / per_iter * threads;
+    if (root.decided(static_cast<int>(std::min<long long>(
+            remaining, std::numeric_limits<int>::max())))) {
+      return;
+    }
+  }
 }
 
-OurUctNode::OurUctNode(Board board, Color color)
-    : OurUctNode(
-          StateDistribution(std::vector<Board>(kNumParticlesRollout, board)),
-          color) {}
+// A hash of `color`'s pieces and castling rights. Every particle agrees on
+// these, so move orders that reach the same position of ours share it, even
+// though their particle sets never match exactly.
+uint64_t position_key(const StateDistribution &state, Color color) {
+  if (state.particles.empty()) {
+    return 0;
+  }
+  const Board &board = state.particles[0];
+  uint64_t key = 0;
+  for (PieceType type : {PieceType::PAWN, PieceType::QUEEN, PieceType::KING,
+                         PieceType::ROOK, PieceType::KNIGHT,
+                         PieceType::BISHOP}) {
+    key = mix64(key ^ board.pieces(color, type));
+  }
+  bool kingside = color == Color::WHITE ? board.get_castle_kingside_white()
+                                        : board.get_castle_kingside_black();
+  bool queenside = color == Color::WHITE ? board.get_castle_queenside_white()
+                                         : board.get_castle_queenside_black();
+  return mix64(key ^ (kingside ? 1 : 0) ^ (queenside ? 2 : 0));
+}
+
+// The transposition table key for playing `move` from `position`.
+uint64_t entry_key(uint64_t position, Move move) {
+  uint64_t from = square_index(move.from.rank, move.from.file);
+  uint64_t to = square_index(move.to.rank, move.to.file);
+  return mix64(position ^ mix64(from * 64 + to));
+}
+
+// The weighted mean value of the piece on the target square of `move`.
+double capture_value(const StateDistribution &state, Move move) {
+  double total = 0;
+  for (size_t i = 0; i < state.particles.size(); i++) {
+    Piece target = state.particles[i].get_piece(move.to.rank, move.to.file);
+    total += piece_value(target.type) * state.weights[i];
+  }
+  return total / state.total_weight();
+}
 
-OurUctNode::OurUctNode(StateDistribution state, Color color)
-    : state(state), color(color) {
+// The move with the most visits summed over independent trees.
+Move most_visited_move(const std::vector<std::unique_ptr<OurUctNode>> &roots) {
+  std::map<Move, int> visits;
+  for (const auto &root : roots) {
+    for (const UcbEntry &entry : root->entries()) {
+      visits[entry.our_move] += entry.count;
+    }
+  }
+  return std::max_element(visits.begin(), visits.end(),
+                          [](const std::pair<const Move, int> &a,
+                             const std::pair<const Move, int> &b) {
+                            return a.second < b.second;
+                          })
+      ->first;
+}
+
+}  // namespace
+
+Move search(const StateDistribution &beliefs, Color color, SearchMode mode,
+            double seconds, int depth) {
+  SearchTree tree(kSingleSearchTableBytes);
+  return tree.search(beliefs, color, mode, seconds, depth);
+}
+
+SearchTree::SearchTree(size_t table_bytes) : table(table_bytes) { reset(); }
+
+SearchTree::~SearchTree() {}
+
+void SearchTree::reset() {
+  root.reset();
+  arena.reset(new UctArena);
+  opponent_node = UctArena::kNone;
+}
+
+Move SearchTree::search(const StateDistribution &beliefs, Color color,
+                        SearchMode mode, double seconds, int depth) {
+  Clock::time_point deadline =
+      Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                         std::chrono::duration<double>(seconds));
+  auto new_root = [&](UctArena &arena) {
+    return std::unique_ptr<OurUctNode>(new OurUctNode(
+        beliefs.subsample(kNumParticlesRollout), color, arena, &table));
+  };
+  table.new_generation();
+  if (root != nullptr) {
+    rebase_root(beliefs);
+  }
+
+  ThreadPool &pool = ThreadPool::global();
+  if (mode != SearchMode::ROOT_PARALLEL || pool.size() == 1) {
+    if (root == nullptr) {
+      root = new_root(*arena);
+    }
+    if (mode == SearchMode::TREE_PARALLEL && pool.size() > 1) {
+      pool.parallel_for(pool.size(), 1, [&](size_t, size_t, size_t) {
+        simulate_until(*root, deadline, depth, pool.size());
+      });
+    } else {
+      simulate_until(*root, deadline, depth, 1);
+    }
+    chosen_move = root->most_visited_entry().our_move;
+    return chosen_move;
+  }
+
+  // The kept tree, if any, is the first of the independent trees. Building a
+  // root is expensive, so each thread builds its own, in its own arena.
+  std::vector<std::unique_ptr<UctArena>> arenas(pool.size());
+  std::vector<std::unique_ptr<OurUctNode>> roots(pool.size());
+  arenas[0] = std::move(arena);
+  roots[0] = std::move(root);
+  pool.parallel_for(roots.size(), 1,
+                    [&](size_t, size_t begin, size_t end) {
+                      for (size_t t = begin; t < end; t++) {
+                        if (arenas[t] == nullptr) {
+                          arenas[t].reset(new UctArena);
+                        }
+                        if (roots[t] == nullptr) {
+                          roots[t] = new_root(*arenas[t]);
+                        }
+                        simulate_until(*roots[t], deadline, depth, 1);
+                      }
+                    });
+  chosen_move = most_visited_move(roots);
+  arena = std::move(arenas[0]);
+  root = std::move(roots[0]);
+  return chosen_move;
+}
+
+void SearchTree::rebase_root(const StateDistribution &beliefs) {
+  // The kept particles were subsampled a turn ago, and may include boards
+  // the sense result has since ruled out.
+  if (!root->rebase(beliefs.subsample(kNumParticlesRollout))) {
+    reset();
+    return;
+  }
+  // Nothing refers to the old opponent nodes any more.
+  std::unique_ptr<UctArena> fresh(new UctArena);
+  root->relocate(*fresh);
+  arena = std::move(fresh);
+}
+
+void SearchTree::advance_our_move(Move taken_move) {
+  opponent_node = UctArena::kNone;
+  if (root != nullptr) {
+    for (UcbEntry &entry : root->entries()) {
+      if (entry.our_move != chosen_move) {
+        continue;
+      }
+      for (UcbEntry::Child &child : entry.children) {
+        if (child.taken_move == taken_move) {
+          opponent_node = child.node;
+        }
+      }
+    }
+  }
+  root.reset();
+  if (opponent_node == UctArena::kNone) {
+    reset();
+  }
+}
+
+void SearchTree::advance_opponent_move(bool captured_piece, Position square) {
+  OurUctNode *next = nullptr;
+  if (opponent_node != UctArena::kNone) {
+    next = (*arena)[opponent_node].find_child(captured_piece, square);
+  }
+  if (next == nullptr) {
+    reset();
+    return;
+  }
+
+  // Keep only the subtree we're in, compacted into a fresh arena.
+  std::unique_ptr<UctArena> kept(new UctArena);
+  root.reset(new OurUctNode(std::move(*next)));
+  root->relocate(*kept);
+  arena = std::move(kept);
+  opponent_node = UctArena::kNone;
+}
+
+void SearchTree::observe(const Observation &obs) {
+  if (root == nullptr) {
+    return;
+  }
+  double fraction = root->particles().consistent_fraction(obs);
+  if (fraction == 0) {
+    reset();
+    return;
+  }
+  root->reweight(fraction);
+}
+
+OurUctNode::OurUctNode(Board board, Color color, UctArena &arena,
+                       TranspositionTable *table)
+    : OurUctNode(StateDistribution(board, kNumParticlesRollout), color, arena,
+                 table) {}
+
+OurUctNode::OurUctNode(const StateDistribution &state, Color color,
+                       UctArena &arena, TranspositionTable *table)
+    : state(state), color(color), arena(&arena), table(table) {
   // Calculate the list of moves.
   state.CheckValid(color);
-  for (Move m : state.get_available_actions(color)) {
-    ucb_table.emplace_back(state, m, color);
-    ucb_table.back().value += random_float(-1e-200, 1e-200);
-    count += 2;
+  MoveList moves;
+  state.get_available_actions(color, moves);
+
+  // Widen in order of the expected value of what each move captures.
+  std::vector<std::pair<double, Move>> ordered;
+  ordered.reserve(moves.size());
+  for (Move m : moves) {
+    ordered.emplace_back(capture_value(state, m), m);
+  }
+  std::stable_sort(ordered.begin(), ordered.end(),
+                   [](const std::pair<double, Move> &a,
+                      const std::pair<double, Move> &b) {
+                     return a.first > b.first;
+                   });
+
+  ucb_table.reserve(ordered.size());
+  uint64_t position = position_key(state, color);
+  for (auto &m : ordered) {
+    ucb_table.emplace_back(m.second, color, entry_key(position, m.second));
   }
 
   // TODO(Kyle): Check that all boards have the same pieces for us.
@@ -44,98 +280,232 @@ double calculate_ucb(double value, double n, double N) {
 
 void OurUctNode::print_moves() {
   for (UcbEntry &entry : ucb_table) {
-    std::cout << entry.our_move << " with value " << entry.value << " and UCB "
-              << calculate_ucb(entry.value, entry.count, count) << std::endl;
+    CHESS_LOG(INFO) << entry.our_move << " with value " << entry.value
+                    << " and UCB "
+                    << calculate_ucb(entry.value, entry.count, count);
   }
 }
 
 double OurUctNode::simulate(int depth) {
-  if (depth < 0) {
+  if (depth < 0 || ucb_table.empty()) {
+    // Out of depth, or we have no moves: nothing to look ahead at.
     return 0;
   }
 
-  UcbEntry &best_entry = find_best_entry();
+  UcbEntry *best_entry;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    best_entry = &find_best_entry();
+    std::lock_guard<std::mutex> entry_lock(best_entry->mutex);
+    best_entry->virtual_loss++;
+    count++;
+  }
 
-  count++;
-  return best_entry.simulate(depth);
+  double result = best_entry->simulate(state, depth, *arena, table);
+
+  std::lock_guard<std::mutex> entry_lock(best_entry->mutex);
+  best_entry->virtual_loss--;
+  return result;
 }
 
 UcbEntry &OurUctNode::find_best_entry() {
+  assert(!ucb_table.empty());
+  size_t width = static_cast<size_t>(
+      kWideningConstant * std::pow(count + 1, kWideningExponent));
+  width = std::min(std::max<size_t>(1, width), ucb_table.size());
+
   // Find the largest UCB entry, by UCB.
-  UcbEntry &best_entry =
-      *std::max_element(ucb_table.begin(), ucb_table.end(),
-                        [&](const UcbEntry &a, const UcbEntry &b) {
-                          return calculate_ucb(a.value, a.count, count) <
-                                 calculate_ucb(b.value, b.count, count);
-                        });
+  UcbEntry *best_entry = nullptr;
+  double best_ucb = 0;
+  for (size_t i = 0; i < width; i++) {
+    UcbEntry &entry = ucb_table[i];
+    double ucb;
+    {
+      std::lock_guard<std::mutex> lock(entry.mutex);
+      ucb = entry.ucb(count);
+    }
+    if (best_entry == nullptr || ucb > best_ucb) {
+      best_entry = &entry;
+      best_ucb = ucb;
+    }
+  }
 
-  return best_entry;
+  return *best_entry;
 }
 
-UcbEntry::UcbEntry(const StateDistribution &state_prior, Move our_move,
-                   Color our_color)
-    : our_color(our_color), our_move(our_move), count(0) {
-  std::vector<std::tuple<int, Move, StateDistribution>> result_dists;
-  std::tie(reward, result_dists) = state_prior.update(our_move, our_color);
+UcbEntry &OurUctNode::most_visited_entry() {
+  assert(!ucb_table.empty());
+  return *std::max_element(ucb_table.begin(), ucb_table.end(),
+                           [](const UcbEntry &a, const UcbEntry &b) {
+                             return a.count < b.count;
+                           });
+}
 
-  double reward_heuristic = 0;
+bool OurUctNode::decided(int remaining) {
+  int first = 0, second = 0;
+  for (UcbEntry &entry : ucb_table) {
+    int entry_count;
+    {
+      std::lock_guard<std::mutex> lock(entry.mutex);
+      entry_count = entry.count;
+    }
+    if (entry_count > first) {
+      second = first;
+      first = entry_count;
+    } else if (entry_count > second) {
+      second = entry_count;
+    }
+  }
+  return first - second > remaining;
+}
 
-  std::vector<double> weights;
-  for (auto &d : result_dists) {
-    auto thingy = std::get<2>(d);
-    std::get<2>(d).CheckValid(our_color);
-    children.push_back(std::make_pair(nullptr, std::get<2>(d)));
-    weights.push_back(std::get<0>(d));
+void OurUctNode::reweight(double fraction) {
+  for (UcbEntry &entry : ucb_table) {
+    entry.count = static_cast<int>(entry.count * fraction);
+  }
+  count = static_cast<int>(count * fraction);
+}
 
-    double h = std::get<2>(d).heuristic_value(our_color);
-    reward_heuristic += h * std::get<0>(d) * (1 - reward);
+bool OurUctNode::rebase(const StateDistribution &new_state) {
+  MoveList moves;
+  new_state.get_available_actions(color, moves);
+  if (moves.size() != ucb_table.size()) {
+    return false;
+  }
+  for (const UcbEntry &entry : ucb_table) {
+    if (std::find(moves.begin(), moves.end(), entry.our_move) == moves.end()) {
+      return false;
+    }
   }
 
-  reward += reward_heuristic;
-  count = 2;
+  state = new_state;
+  state.CheckValid(color);
+  for (UcbEntry &entry : ucb_table) {
+    entry.children.clear();
+    entry.child_weights = std::discrete_distribution<int>();
+    entry.outcomes = MoveOutcomes();
+    entry.num_built = 0;
+    entry.expanded = false;
+  }
+  return true;
+}
 
-  value = reward;
+void OurUctNode::relocate(UctArena &to) {
+  for (UcbEntry &entry : ucb_table) {
+    for (UcbEntry::Child &child : entry.children) {
+      if (child.node != UctArena::kNone) {
+        child.node = to.emplace(std::move((*arena)[child.node]));
+        to[child.node].relocate(to);
+      }
+    }
+  }
+  arena = &to;
+}
 
+UcbEntry::UcbEntry(Move our_move, Color our_color, uint64_t key)
+    : our_color(our_color), our_move(our_move), count(0), key(key) {}
+
+void UcbEntry::expand(const StateDistribution &state_prior,
+                      TranspositionTable *table) {
+  double immediate = state_prior.update(our_move, our_color, &outcomes);
+
+  TranspositionTable::Entry shared;
+  bool hit = table != nullptr && table->lookup(key, &shared);
+  double reward_heuristic = 0;
+
+  int total_weight = state_prior.total_weight();
+  std::vector<double> weights;
+  for (const MoveOutcomes::Group &group : outcomes.groups) {
+    children.push_back(Child{group.taken_move, UctArena::kNone});
+    weights.push_back(group.weight);
+    reward_heuristic += group.heuristic * group.weight /
+                        static_cast<double>(total_weight) * (1 - immediate);
+  }
   child_weights =
       std::discrete_distribution<int>(weights.begin(), weights.end());
+
+  std::lock_guard<std::mutex> lock(mutex);
+  reward = immediate + reward_heuristic;
+  if (table != nullptr && !hit) {
+    table->store(key, reward);
+  }
+  // With a count already, the statistics are from an earlier search, on
+  // particles since replaced, and are kept.
+  if (count == 0) {
+    count = 2;
+    value = reward;
+    if (hit) {
+      // Our pieces were reached some other way: start from what that search
+      // found. Its opponent pieces differ, so the immediate reward is still
+      // our own, and its visits weren't made here: they only shape the
+      // value, not the count that picks the move and stops the search.
+      value = (2 * reward + shared.count * shared.value) / (2 + shared.count);
+    }
+  }
+  value += random_float(-1e-200, 1e-200);
+  expanded = true;
 }
 
-double UcbEntry::simulate(int depth) {
-  double reward = value;
+double UcbEntry::ucb(int parent_count) const {
+  int n = count + virtual_loss;
+  if (n == 0) {
+    return calculate_ucb(value, n, parent_count);
+  }
+  return calculate_ucb((value * count - virtual_loss) / n, n, parent_count);
+}
+
+double UcbEntry::simulate(const StateDistribution &state_prior, int depth,
+                          UctArena &arena, TranspositionTable *table) {
+  OpponentUctNode *node;
+  {
+    std::lock_guard<std::mutex> lock(expand_mutex);
+    if (!expanded) {
+      expand(state_prior, table);
+    }
+    size_t i = child_weights(get_random_engine());
+    auto &child = children[i];
+    if (child.node == UctArena::kNone) {
+      child.node = arena.emplace(
+          state_prior.outcome(our_move, our_color, outcomes, i), our_color,
+          arena, table);
+      if (++num_built == children.size()) {
+        // Every child has its particles now.
+        outcomes = MoveOutcomes();
+      }
+    }
+    node = &arena[child.node];
+  }
 
-  int idx = child_weights(get_random_engine());
-  auto &node = children[idx];
-  if (node.first == nullptr) {
-    node.first = new OpponentUctNode(node.second, our_color);
+  double reward;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    reward = value;
   }
 
   if (reward < 1 - 1e-10) {
-    double sim_reward = node.first->simulate(depth);
+    double sim_reward = node->simulate(depth);
     reward += 0.95 * (1 - reward) * sim_reward;
   }
+  if (table != nullptr) {
+    table->add_sample(key, this->reward, reward);
+  }
 
+  std::lock_guard<std::mutex> lock(mutex);
   count++;
   value += (reward - value) / count;
   return value;
 }
 
-void UcbEntry::generate() {}
-
-UcbEntry::~UcbEntry() {
-  for (auto &c : children) {
-    if (c.first) {
-      delete c.first;
-    }
-  }
-}
-
 OpponentUctNode::OpponentUctNode(const StateDistribution &state_prior,
-                                 Color our_color)
-    : state(state_prior) {
+                                 Color our_color, UctArena &arena,
+                                 TranspositionTable *table)
+    : our_color(our_color) {
   int total_count = 0;
   std::vector<double> weights;
 
-  for (auto t : state_prior.update_random(opponent(our_color))) {
+  auto outcomes = state_prior.update_random(opponent(our_color));
+  children.reserve(outcomes.size());
+  for (auto &t : outcomes) {
     int count = std::get<0>(t);
     Capture capture = std::get<1>(t);
 
@@ -143,8 +513,8 @@ OpponentUctNode::OpponentUctNode(const StateDistribution &state_prior,
     if (capture.piece.type == PieceType::KING) {
       reward -= count;
     } else {
-      StateDistribution dist = std::get<2>(t);
-      children.push_back(OurUctNode(state, our_color));
+      children.emplace_back(std::get<2>(t), our_color, arena, table);
+      child_captures.push_back(capture);
       weights.push_back(count);
     }
   }
@@ -158,13 +528,37 @@ OpponentUctNode::OpponentUctNode(const StateDistribution &state_prior,
 }
 
 double OpponentUctNode::simulate(int depth) {
-  OurUctNode &child = children[child_weights(get_random_engine())];
-  double R = reward + (1 + reward) * child.simulate(depth - 1);
+  // With no children every particle took our king, and reward is all there
+  // is.
+  double R = reward;
+  if (!children.empty()) {
+    OurUctNode &child = children[child_weights(get_random_engine())];
+    R += (1 + reward) * child.simulate(depth - 1);
+  }
+  std::lock_guard<std::mutex> lock(mutex);
   count++;
   value += (R - value) / count;
   return value;
 }
 
+OurUctNode *OpponentUctNode::find_child(bool captured_piece,
+                                        Position square) {
+  for (size_t i = 0; i < children.size(); i++) {
+    const Capture &capture = child_captures[i];
+    if (captured_piece ? capture.position == square
+                       : capture == Capture::NONE) {
+      return &children[i];
+    }
+  }
+  return nullptr;
+}
+
+void OpponentUctNode::relocate(UctArena &to) {
+  for (OurUctNode &child : children) {
+    child.relocate(to);
+  }
+}
+
 }  // namespace agent
 
 }  // namespace chess
@@ -1,9 +1,12 @@
 #include <memory>
+#include <mutex>
 #include <random>
 #include <vector>
 
+#include "arena.h"
 #include "chess.h"
 #include "particle_filter.h"
+#include "transposition.h"
 
 namespace chess {
 
@@ -11,16 +14,112 @@ namespace agent {
 
 constexpr double kUcbConstant = 1;
 
+// Progressive widening: a node with N simulations considers its
+// kWideningConstant * (N + 1) ^ kWideningExponent most promising moves.
+constexpr double kWideningConstant = 2;
+constexpr double kWideningExponent = 0.5;
+
 class OurUctNode;
 class OpponentUctNode;
 struct UcbEntry;
 
+// Owns every opponent node of a search tree, and with them the rest of the
+// tree.
+using UctArena = Arena<OpponentUctNode>;
+
+// How choose_move spreads its search over the global thread pool.
+enum class SearchMode {
+  // A single tree on the calling thread.
+  SERIAL,
+  // An independent tree per thread, each on its own subsample of the beliefs.
+  // The root statistics are merged at the end.
+  ROOT_PARALLEL,
+  // All threads search one shared tree, using virtual loss to keep them from
+  // piling onto the same line.
+  TREE_PARALLEL,
+};
+
+// Transposition table size for a one-off search. Nothing is carried over to
+// a later turn, so it only needs to hold one search's entries.
+constexpr size_t kSingleSearchTableBytes = 4 << 20;
+
+// Search from `beliefs` for up to `seconds` of wall-clock time and return the
+// most visited move. Stops early once the leader can't be overtaken in the
+// time left, judging by how long iterations have taken so far.
+Move search(const StateDistribution &beliefs, Color color, SearchMode mode,
+            double seconds, int depth);
+
+// A search tree kept between turns. After each search, advance it along what
+// actually happened, and the next search starts from the move statistics
+// already gathered at that point. Its particles are rebuilt from the beliefs
+// passed to that search, so nothing ruled out since is searched again.
+// Anything it can't follow drops the tree, and the next search starts from
+// scratch.
+class SearchTree {
+ public:
+  explicit SearchTree(size_t table_bytes = kTranspositionTableBytes);
+  ~SearchTree();
+
+  // As the free function, but starting from the kept root if there is one,
+  // rebuilt on `beliefs`. Keeps the searched tree.
+  Move search(const StateDistribution &beliefs, Color color, SearchMode mode,
+              double seconds, int depth);
+
+  // The move we asked for, from the last search, turned into `taken_move`.
+  void advance_our_move(Move taken_move);
+
+  // The opponent moved, capturing on `square` if `captured_piece`.
+  void advance_opponent_move(bool captured_piece, Position square);
+
+  // Scale the root's statistics by the fraction of its particles that agree
+  // with our sense result.
+  void observe(const Observation &obs);
+
+  void reset();
+
+  bool has_root() const { return root != nullptr; }
+  // The kept root. has_root() must be true.
+  const OurUctNode &root_node() const { return *root; }
+
+ private:
+  // Restart the kept root from `beliefs`, or drop the tree if it can't be.
+  void rebase_root(const StateDistribution &beliefs);
+
+  std::unique_ptr<UctArena> arena;
+
+  // Outlives any one tree, so transpositions from earlier turns still count.
+  TranspositionTable table;
+
+  // Set after a search, or after following an opponent move.
+  std::unique_ptr<OurUctNode> root;
+  Move chosen_move;
+
+  // Set after following our move.
+  UctArena::Index opponent_node;
+};
+
+// A std::mutex that can be stored in a std::vector. Moving it gives a fresh,
+// unlocked mutex, so nodes may only be moved before they're shared between
+// threads.
+class NodeMutex : public std::mutex {
+ public:
+  NodeMutex() = default;
+  NodeMutex(NodeMutex &&) {}
+  NodeMutex &operator=(NodeMutex &&) { return *this; }
+};
+
 // A game state represented by a set of particles.
 // Corresponds to T(ha).
 class OurUctNode {
  public:
-  OurUctNode(Board board, Color color);
-  OurUctNode(StateDistribution state, Color color);
+  // Only lists the moves; each entry does its particle work the first time
+  // it's selected. Opponent nodes below this one are allocated from `arena`,
+  // which must outlive the node. Entries share statistics through `table`, if
+  // given.
+  OurUctNode(Board board, Color color, UctArena &arena,
+             TranspositionTable *table = nullptr);
+  OurUctNode(const StateDistribution &state, Color color, UctArena &arena,
+             TranspositionTable *table = nullptr);
 
   void print_moves();
 
@@ -28,67 +127,140 @@ class OurUctNode {
 
   double get_value() const;
 
+  // The entry to simulate next, among those progressive widening allows.
+  // There must be at least one entry.
   UcbEntry &find_best_entry();
 
+  // The entry with the most visits: the move to play. There must be at
+  // least one entry.
+  UcbEntry &most_visited_entry();
+
+  // Whether `remaining` more visits can't change the most visited entry.
+  bool decided(int remaining);
+
+  const std::vector<UcbEntry> &entries() const { return ucb_table; }
+  std::vector<UcbEntry> &entries() { return ucb_table; }
+
+  // Scale every visit count by `fraction`, so new simulations can outweigh
+  // statistics gathered from particles we no longer believe in.
+  void reweight(double fraction);
+
+  // Replace the particles with `state`, keeping each entry's statistics as a
+  // prior. Entries drop their children, which were built from the old
+  // particles, and expand again from the new ones. Returns false, changing
+  // nothing, unless `state` offers the same moves.
+  bool rebase(const StateDistribution &state);
+
+  // Move every opponent node below this one into `to`. Not thread-safe.
+  void relocate(UctArena &to);
+
+  // The particles this node was built from.
+  const StateDistribution &particles() const { return state; }
+
  private:
   // The state distribution before our move.
   StateDistribution state;
 
   Color color;
   std::vector<UcbEntry> ucb_table;
+  UctArena *arena;
+  TranspositionTable *table;
 
+  // Guards count, and makes picking an entry and adding its virtual loss
+  // atomic.
+  NodeMutex mutex;
   int count = 0;
 };
 
 // A set of particles plus the next action to be taken by us.
 // Corresponds to T(ha).
 struct UcbEntry {
-  UcbEntry(const StateDistribution &state_prior, Move our_move,
-           Color our_color);
-  ~UcbEntry();
+  // An unexpanded entry. `key` identifies (particles, our_move) in the
+  // transposition table.
+  UcbEntry(Move our_move, Color our_color, uint64_t key);
 
-  double simulate(int depth);
+  // Apply our move to the parent's particles and work out the reward. A hit
+  // in `table` shapes the starting value, but not the visit count, with the
+  // shared statistics. An entry kept from an earlier search keeps its own
+  // statistics. Call with expand_mutex held.
+  void expand(const StateDistribution &state_prior, TranspositionTable *table);
 
-  void generate();
+  // Expands the entry first if needed. `state_prior` must be the
+  // distribution it was expanded from: children refer to its particles.
+  double simulate(const StateDistribution &state_prior, int depth,
+                  UctArena &arena, TranspositionTable *table);
 
-  // Create the opponent nodes.
-  // void generate();
+  // UCB score given the parent's visit count, counting each pending
+  // simulation as a loss.
+  double ucb(int parent_count) const;
 
   Color our_color;
 
   // The corresponding move
   Move our_move;
 
+  struct Child {
+    // What our move actually did in these particles.
+    Move taken_move;
+    // An arena index, or UctArena::kNone until expanded.
+    UctArena::Index node;
+  };
+
   // The opponent's UCT nodes are initialized in a lazy fashion
-  // to save on RAM usage.
-  std::vector<std::pair<OpponentUctNode *, StateDistribution>> children;
+  // to save on RAM usage. Guarded by expand_mutex.
+  std::vector<Child> children;
   std::discrete_distribution<int> child_weights;
+  // Which of the parent's particles each child starts from, in the same
+  // order. Dropped once every child is built.
+  MoveOutcomes outcomes;
+  size_t num_built = 0;
+  bool expanded = false;
+  NodeMutex expand_mutex;
+
+  // Guards count, value and virtual_loss.
+  NodeMutex mutex;
 
   // The number of times this entry has been taken.
   int count = 0;
 
+  // Simulations through this entry that haven't finished yet.
+  int virtual_loss = 0;
+
   // The expected value of this entry.
   double value = 0;
 
   // The immediate reward for having taken this action.
   double reward = 0;
+
+  uint64_t key;
 };
 
 // Allows us to split the tree on opponent moves. This is not
 // included in the paper on POMCPs.
 class OpponentUctNode {
  public:
-  OpponentUctNode(const StateDistribution &state_prior, Color our_color);
+  OpponentUctNode(const StateDistribution &state_prior, Color our_color,
+                  UctArena &arena, TranspositionTable *table);
 
   // Returns the reward from a single simulated instance.
   double simulate(int depth);
 
+  // Our node after an opponent move that captured on `square` if
+  // `captured_piece`, or null if none of our particles did that.
+  OurUctNode *find_child(bool captured_piece, Position square);
+
+  // Move this node's subtree into `to`, as OurUctNode::relocate.
+  void relocate(UctArena &to);
+
  private:
   Color our_color;
 
   // Immediate reward, calculated from wins - losses in initial particles.
   double reward = 0;
 
+  // Guards value and count.
+  NodeMutex mutex;
+
   double value = 0;
 
   // The total number of times this node has been explored.
@@ -96,12 +268,11 @@ class OpponentUctNode {
   // (those games are assumed to be simulated out fully).
   int count = 0;
 
+  // Our nodes for each capture outcome other than losing our king.
   std::vector<OurUctNode> children;
+  std::vector<Capture> child_captures;
 
   std::discrete_distribution<int> child_weights;
-
-  // The state before the opponent move.
-  StateDistribution state;
 };
 
 }  // namespace agent
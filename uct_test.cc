@@ -1,5 +1,9 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <cmath>
+#include "thread_pool.h"
 #include "uct.h"
+#include "util.h"
 
 namespace chess {
 
@@ -10,7 +14,8 @@ namespace test {
 TEST(Uct, MakesTrivialMove) {
     Board starting_board = Board::initial_board();
 
-    OurUctNode root(starting_board, Color::WHITE);
+    UctArena arena;
+    OurUctNode root(starting_board, Color::WHITE, arena);
 
     for (int i = 0; i < 1000; i++) {
         root.simulate(10);
@@ -18,6 +23,420 @@ TEST(Uct, MakesTrivialMove) {
     root.print_moves();
 }
 
+TEST(Uct, ExpandsEntriesLazily) {
+    UctArena arena;
+    OurUctNode root(Board::initial_board(), Color::WHITE, arena);
+    auto num_expanded = [&root]() {
+        return std::count_if(root.entries().begin(), root.entries().end(),
+                             [](const UcbEntry &e) { return e.expanded; });
+    };
+    EXPECT_EQ(num_expanded(), 0);
+
+    root.simulate(5);
+    EXPECT_EQ(num_expanded(), 1);
+}
+
+TEST(Uct, SimulatesWithoutMoves) {
+    // White has nothing left to move.
+    Board board;
+    board.set_piece(7, 4, Piece{Color::BLACK, PieceType::KING});
+    UctArena arena;
+    OurUctNode root(board, Color::WHITE, arena);
+    ASSERT_TRUE(root.entries().empty());
+    EXPECT_EQ(root.simulate(5), 0);
+}
+
+TEST(Uct, SimulatesLostKing) {
+    // Black's only move takes the white king, so no particle survives it.
+    Board board;
+    board.set_piece(0, 0, Piece{Color::WHITE, PieceType::KING});
+    for (Position pawn : {Position(0, 1), Position(0, 2), Position(1, 1)}) {
+        board.set_piece(pawn.rank, pawn.file,
+                        Piece{Color::BLACK, PieceType::PAWN});
+    }
+    UctArena arena;
+    OpponentUctNode node(StateDistribution(board, 4), Color::WHITE, arena,
+                         nullptr);
+    EXPECT_EQ(node.simulate(5), -1);
+}
+
+TEST(Uct, ParallelSearchModes) {
+    ThreadPool::global().resize(4);
+    StateDistribution beliefs(Board::initial_board(), kNumParticles);
+    std::vector<Move> legal = Board::initial_board().generate_moves(Color::WHITE);
+    for (SearchMode mode : {SearchMode::SERIAL, SearchMode::ROOT_PARALLEL,
+                            SearchMode::TREE_PARALLEL}) {
+        Move move = search(beliefs, Color::WHITE, mode, 0.5, 5);
+        EXPECT_NE(std::find(legal.begin(), legal.end(), move), legal.end());
+    }
+    ThreadPool::global().resize(1);
+}
+
+TEST(Uct, SearchTreeFollowsTheGame) {
+    Board board = Board::initial_board();
+    StateDistribution beliefs(board, kNumParticles);
+    SearchTree tree;
+    Move move = tree.search(beliefs, Color::WHITE, SearchMode::SERIAL, 0.3, 5);
+    ASSERT_TRUE(tree.has_root());
+
+    Board after = board;
+    tree.advance_our_move(after.apply_move(move).move);
+    EXPECT_FALSE(tree.has_root());
+
+    // Black can't capture anything from the starting position.
+    tree.advance_opponent_move(false, Position::NONE);
+    ASSERT_TRUE(tree.has_root());
+
+    // Nothing black does in one move reaches our corner.
+    Observation obs;
+    obs.origin = {0, 0};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            obs.obs[i][j] = after.get_piece(i, j);
+        }
+    }
+    tree.observe(obs);
+    EXPECT_TRUE(tree.has_root());
+
+    // Something none of the particles predicted drops the tree.
+    obs.obs[2][0] = Piece{Color::BLACK, PieceType::QUEEN};
+    tree.observe(obs);
+    EXPECT_FALSE(tree.has_root());
+}
+
+TEST(Uct, KeptRootFollowsTheBeliefs) {
+    get_random_engine().seed(3);
+    Board board = Board::initial_board();
+    SearchTree tree;
+    Move move = tree.search(StateDistribution(board, kNumParticles),
+                            Color::WHITE, SearchMode::SERIAL, 0.3, 5);
+    Board after = board;
+    tree.advance_our_move(after.apply_move(move).move);
+    tree.advance_opponent_move(false, Position::NONE);
+    ASSERT_TRUE(tree.has_root());
+    StateDistribution kept = tree.root_node().particles();
+
+    // Sense black's side of one kept particle, somewhere the particles
+    // disagree.
+    const Board &truth = kept.particles[0];
+    Observation obs;
+    for (int file = 0; file < 6; file++) {
+        obs.origin = {5, file};
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                obs.obs[i][j] = truth.get_piece(5 + i, file + j);
+            }
+        }
+        if (kept.consistent_fraction(obs) < 1) {
+            break;
+        }
+    }
+    ASSERT_LT(kept.consistent_fraction(obs), 1);
+
+    StateDistribution beliefs = kept;
+    beliefs.observe(obs, Color::WHITE);
+    ASSERT_EQ(beliefs.consistent_fraction(obs), 1);
+    tree.observe(obs);
+    ASSERT_TRUE(tree.has_root());
+    int visits = 0;
+    for (const UcbEntry &entry : tree.root_node().entries()) {
+        visits += entry.count;
+    }
+
+    tree.search(beliefs, Color::WHITE, SearchMode::SERIAL, 0.3, 5);
+    ASSERT_TRUE(tree.has_root());
+    // Every expansion ran on boards that agree with the sense result, and the
+    // kept statistics carried over.
+    const OurUctNode &root = tree.root_node();
+    EXPECT_EQ(root.particles().consistent_fraction(obs), 1);
+    int expanded = 0;
+    int visits_after = 0;
+    for (const UcbEntry &entry : root.entries()) {
+        expanded += entry.expanded;
+        visits_after += entry.count;
+    }
+    EXPECT_GT(expanded, 0);
+    EXPECT_GT(visits_after, visits);
+}
+
+TEST(Uct, TranspositionHitOnlySetsTheValue) {
+    TranspositionTable table(1 << 16);
+    UctArena arena;
+    OurUctNode root(Board::initial_board(), Color::WHITE, arena, &table);
+    // Unvisited entries all look infinitely good, so the first is expanded
+    // first.
+    const UcbEntry &entry = root.entries()[0];
+    table.store(entry.key, 0.0);
+    for (int i = 0; i < 100; i++) {
+        table.add_sample(entry.key, 0.0, 1.0);
+    }
+
+    root.simulate(1);
+    ASSERT_TRUE(entry.expanded);
+    // Two for the expansion and one for the simulation, none imported.
+    EXPECT_EQ(entry.count, 3);
+    EXPECT_GT(entry.value, 0.9);
+}
+
+TEST(TranspositionTable, SharesAndReplaces) {
+    // A single two-way bucket.
+    TranspositionTable table(2 * sizeof(TranspositionTable::Entry));
+    TranspositionTable::Entry entry;
+    EXPECT_FALSE(table.lookup(10, &entry));
+
+    table.store(10, 0.5);
+    table.add_sample(10, 0.5, 1.0);
+    table.add_sample(10, 0.5, 0.0);
+    ASSERT_TRUE(table.lookup(10, &entry));
+    EXPECT_EQ(entry.reward, 0.5);
+    EXPECT_EQ(entry.count, 2);
+    EXPECT_EQ(entry.value, 0.5);
+
+    // A full bucket gives up its least simulated entry first...
+    table.store(20, 0.0);
+    table.store(30, 0.0);
+    EXPECT_TRUE(table.lookup(10, &entry));
+    EXPECT_FALSE(table.lookup(20, &entry));
+
+    // ...unless the busier one is from an older search.
+    table.new_generation();
+    table.store(30, 0.0);
+    table.store(40, 0.0);
+    EXPECT_FALSE(table.lookup(10, &entry));
+    EXPECT_TRUE(table.lookup(30, &entry));
+}
+
+TEST(ParticleFilter, MergesDuplicateBoards) {
+    StateDistribution dist(std::vector<Board>(kNumParticles, Board::initial_board()));
+    ASSERT_EQ(dist.particles.size(), 1);
+    EXPECT_EQ(dist.total_weight(), kNumParticles);
+
+    // Random opponent moves fan out to at most one board per move, with all
+    // the wasted pawn captures sharing the unchanged board. Every capture
+    // class is topped back up to the full particle count.
+    for (auto &t : dist.update_random(Color::BLACK)) {
+        const StateDistribution &child = std::get<2>(t);
+        EXPECT_LE(child.particles.size(), 21);
+        EXPECT_EQ(child.total_weight(), kNumParticles);
+    }
+
+    StateDistribution small = dist.subsample(kNumParticlesRollout);
+    EXPECT_EQ(small.particles.size(), 1);
+    EXPECT_EQ(small.total_weight(), kNumParticlesRollout);
+}
+
+TEST(ParticleFilter, GroupsMoveOutcomes) {
+    // A knight on e3 blocks e2-e4 in one of the two boards.
+    Board blocked = Board::initial_board();
+    blocked.set_piece(2, 4, Piece{Color::BLACK, PieceType::KNIGHT});
+    StateDistribution dist({Board::initial_board(), blocked}, {3, 1});
+    Move push{{1, 4}, {3, 4}};
+
+    MoveOutcomes outcomes;
+    dist.update(push, Color::WHITE, &outcomes);
+    ASSERT_EQ(outcomes.groups.size(), 2);
+    EXPECT_EQ(outcomes.groups[0].taken_move, push);
+    EXPECT_EQ(outcomes.groups[0].weight, 3);
+    EXPECT_EQ(outcomes.groups[1].weight, 1);
+
+    for (size_t i = 0; i < outcomes.groups.size(); i++) {
+        const MoveOutcomes::Group &group = outcomes.groups[i];
+        ASSERT_EQ(group.end - group.begin, 1);
+        Board expected = dist.particles[outcomes.particle(group.begin)];
+        expected.apply_move(push);
+
+        StateDistribution child = dist.outcome(push, Color::WHITE, outcomes, i);
+        ASSERT_EQ(child.particles.size(), 1);
+        EXPECT_EQ(child.particles[0], expected);
+        EXPECT_EQ(child.total_weight(), 4);
+        EXPECT_NEAR(group.heuristic, child.heuristic_value(Color::WHITE),
+                    1e-9);
+    }
+}
+
+TEST(ParticleFilter, MoveDropsParticlesItCantExplain) {
+    // Our rook moves a1-b1 without capturing. In `open` b1 is empty. In
+    // `full` a black knight is there and there's nowhere to move it, so that
+    // particle can't be right.
+    Piece rook{Color::WHITE, PieceType::ROOK};
+    Piece knight{Color::BLACK, PieceType::KNIGHT};
+    Board open;
+    open.set_piece(0, 0, rook);
+    open.set_piece(7, 7, Piece{Color::BLACK, PieceType::KING});
+    Board full;
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+            full.set_piece(i, j, knight);
+        }
+    }
+    full.set_piece(0, 0, rook);
+    StateDistribution dist({open, full}, {1, 3});
+
+    Move move{{0, 0}, {0, 1}};
+    dist.handle_move_result(move, Color::WHITE, false, Position::NONE);
+    Board expected = open;
+    expected.apply_move(move);
+    ASSERT_EQ(dist.particles.size(), 1);
+    EXPECT_EQ(dist.particles[0], expected);
+    EXPECT_EQ(dist.total_weight(), 4);
+}
+
+TEST(ParticleFilter, ObservationEntropy) {
+    // Two equally likely boards that differ on e3 and e5.
+    Board knight = Board::initial_board();
+    knight.set_piece(2, 4, Piece{Color::BLACK, PieceType::KNIGHT});
+    Board bishop = Board::initial_board();
+    bishop.set_piece(4, 4, Piece{Color::BLACK, PieceType::BISHOP});
+    StateDistribution dist({knight, bishop}, {1, 1});
+
+    // One bit from any window that sees either square, even though it covers
+    // both of them.
+    EXPECT_NEAR(dist.observation_entropy({2, 3}), 1, 1e-9);
+    EXPECT_NEAR(dist.observation_entropy({3, 4}), 1, 1e-9);
+    EXPECT_NEAR(dist.observation_entropy({5, 0}), 0, 1e-9);
+}
+
+TEST(ParticleFilter, ObserveRepairsWhenNothingMatches) {
+    get_random_engine().seed(11);
+    StateDistribution dist(Board::initial_board(), kNumParticlesRollout);
+
+    // Black has played Nf6, which no particle predicted.
+    Board actual = Board::initial_board();
+    actual.apply_move(Move{{7, 6}, {5, 5}});
+    Observation obs;
+    obs.origin = {5, 4};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            obs.obs[i][j] = actual.get_piece(5 + i, 4 + j);
+        }
+    }
+    ASSERT_EQ(dist.consistent_fraction(obs), 0);
+
+    dist.observe(obs, Color::WHITE);
+    EXPECT_EQ(dist.consistent_fraction(obs), 1);
+    EXPECT_EQ(dist.total_weight(), kNumParticlesRollout);
+
+    // Now everything matches, and observing again changes nothing.
+    std::vector<Board> before = dist.particles;
+    dist.observe(obs, Color::WHITE);
+    EXPECT_EQ(dist.particles, before);
+}
+
+#if CHESS_CHECK_LEVEL > 1
+TEST(ParticleFilterDeathTest, CheckValidCatchesDisagreement) {
+    Board moved = Board::initial_board();
+    moved.apply_move(Move{{0, 6}, {2, 5}});
+    StateDistribution dist({Board::initial_board(), moved}, {1, 1});
+    dist.CheckValid(Color::BLACK);
+    EXPECT_DEATH(dist.CheckValid(Color::WHITE), "");
+}
+#endif
+
+// A few rounds of random opponent moves, from a fixed seed.
+StateDistribution spread_particles(int num_threads, uint32_t seed) {
+    ThreadPool::global().resize(num_threads);
+    get_random_engine().seed(seed);
+    StateDistribution dist(Board::initial_board(), kNumParticles);
+    for (int i = 0; i < 3; i++) {
+        dist.handle_opponent_move_result(false, Position::NONE, Color::BLACK);
+    }
+    ThreadPool::global().resize(1);
+    return dist;
+}
+
+TEST(ParticleFilter, ReproducibleForThreadCount) {
+    StateDistribution first = spread_particles(4, 7);
+    StateDistribution second = spread_particles(4, 7);
+    // Enough unique boards that the last pass was split between threads.
+    EXPECT_GT(first.particles.size(), 64);
+    EXPECT_EQ(first.total_weight(), kNumParticles);
+    EXPECT_EQ(first.particles, second.particles);
+    EXPECT_EQ(first.weights, second.weights);
+}
+
+TEST(ParticleFilter, EntropyOfOpponentPieces) {
+    StateDistribution dist = spread_particles(1, 3);
+    std::array<std::array<double, 8>, 8> entropies{};
+    dist.entropy(entropies, Color::WHITE);
+
+    // Squares holding our own pieces don't count.
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+            std::map<PieceType, int> counts;
+            for (size_t k = 0; k < dist.particles.size(); k++) {
+                Piece piece = dist.particles[k].get_piece(i, j);
+                if (piece.color != Color::WHITE) {
+                    counts[piece.type] += dist.weights[k];
+                }
+            }
+            double expected = 0;
+            for (auto &c : counts) {
+                double p = static_cast<double>(c.second) / dist.total_weight();
+                expected -= p * std::log2(p);
+            }
+            EXPECT_NEAR(entropies[i][j], expected, 1e-9);
+        }
+    }
+}
+
+TEST(ParticleFilter, ColumnarDistributionAgrees) {
+    StateDistribution dist = spread_particles(1, 5);
+    ColumnarDistribution columns(dist);
+
+    StateDistribution back = columns.to_distribution();
+    EXPECT_EQ(back.particles, dist.particles);
+    EXPECT_EQ(back.weights, dist.weights);
+    for (size_t k = 0; k < dist.particles.size(); k++) {
+        EXPECT_EQ(back.particles[k].hash(), dist.particles[k].hash());
+    }
+
+    std::array<std::array<double, 8>, 8> rows{}, cols{};
+    dist.entropy(rows, Color::WHITE);
+    columns.entropy(cols, Color::WHITE);
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+            EXPECT_NEAR(cols[i][j], rows[i][j], 1e-9);
+        }
+    }
+
+    for (int i = 0; i < 6; i++) {
+        for (int j = 0; j < 6; j++) {
+            EXPECT_NEAR(columns.observation_entropy({i, j}),
+                        dist.observation_entropy({i, j}), 1e-9);
+        }
+    }
+
+    // Sensing what one of the particles shows, so some match and some don't.
+    Observation obs;
+    obs.origin = {4, 3};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            obs.obs[i][j] = dist.particles.back().get_piece(4 + i, 3 + j);
+        }
+    }
+    double fraction = dist.consistent_fraction(obs);
+    EXPECT_GT(fraction, 0);
+    EXPECT_LT(fraction, 1);
+    EXPECT_DOUBLE_EQ(columns.consistent_fraction(obs), fraction);
+}
+
+TEST(Random, SeededStreams) {
+    Rng a(5, 0), b(5, 0), c(5, 1);
+    uint64_t first = a();
+    EXPECT_EQ(first, b());
+    EXPECT_NE(first, c());
+
+    // Every bucket of a small range gets roughly its share.
+    get_random_engine().seed(5);
+    std::vector<int> counts(6);
+    for (int i = 0; i < 60000; i++) {
+        counts[random_int(6)]++;
+    }
+    for (int count : counts) {
+        EXPECT_NEAR(count, 10000, 500);
+    }
+}
+
 } // namespace test
 
 } // namespace agent
@@ -1,30 +1,115 @@
 #pragma once
+#include <array>
+#include <cstdint>
 #include <vector>
-#include <random>
 
-inline std::mt19937& get_random_engine() {
-    static std::mt19937 mt;
-    return mt;
+// Scramble the bits of `x` (the splitmix64 finalizer), for combining hashes.
+inline uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// xoshiro256++: a small, fast generator with 256 bits of state. Works with the
+// <random> distributions.
+class Rng {
+public:
+    using result_type = uint64_t;
+
+    explicit Rng(uint64_t seed = 0) { this->seed(seed); }
+    Rng(uint64_t seed, uint64_t stream) { this->seed(seed, stream); }
+
+    // Different streams from the same seed are independent.
+    void seed(uint64_t seed, uint64_t stream = 0) {
+        // Expand the seed with splitmix64, as the xoshiro authors suggest.
+        uint64_t x = seed ^ mix64(stream);
+        for (uint64_t& s : state) {
+            x += 0x9E3779B97F4A7C15ULL;
+            s = mix64(x);
+        }
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return ~result_type{0}; }
+
+    result_type operator()() {
+        uint64_t result = rotl(state[0] + state[3], 23) + state[0];
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+
+private:
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    std::array<uint64_t, 4> state;
+};
+
+// Each thread has its own engine; see ScopedRandomStream. Seed the calling
+// thread's engine for a reproducible run: thread pool loops derive their
+// streams from it.
+inline Rng& get_random_engine() {
+    thread_local Rng rng;
+    return rng;
+}
+
+// Reseeds this thread's engine from (seed, stream) and restores the old one
+// when it goes out of scope.
+class ScopedRandomStream {
+public:
+    ScopedRandomStream(uint64_t seed, uint64_t stream)
+        : saved(get_random_engine()) {
+        get_random_engine().seed(seed, stream);
+    }
+    ~ScopedRandomStream() { get_random_engine() = saved; }
+
+    ScopedRandomStream(const ScopedRandomStream&) = delete;
+    ScopedRandomStream& operator=(const ScopedRandomStream&) = delete;
+
+private:
+    Rng saved;
+};
+
+// A uniform integer in [0, range), by Lemire's multiply-shift method: one
+// multiplication, and a division only in the rare case a draw might be
+// biased.
+inline uint32_t random_below(uint32_t range) {
+    Rng& rng = get_random_engine();
+    uint64_t m = static_cast<uint64_t>(rng() >> 32) * range;
+    uint32_t low = static_cast<uint32_t>(m);
+    if (low < range) {
+        uint32_t threshold = -range % range;
+        while (low < threshold) {
+            m = static_cast<uint64_t>(rng() >> 32) * range;
+            low = static_cast<uint32_t>(m);
+        }
+    }
+    return static_cast<uint32_t>(m >> 32);
 }
 
 template<typename T>
 T& random_choice(std::vector<T>& from) {
-    auto dist = std::uniform_int_distribution<size_t>(0, from.size() - 1);
-    return from[dist(get_random_engine())];
+    return from[random_below(from.size())];
 }
 
 template<typename T>
 const T& random_choice(const std::vector<T>& from) {
-    auto dist = std::uniform_int_distribution<size_t>(0, from.size() - 1);
-    return from[dist(get_random_engine())];
+    return from[random_below(from.size())];
 }
 
 inline int random_int(int max_ex) {
-    auto dist = std::uniform_int_distribution<size_t>(0, max_ex - 1);
-    return dist(get_random_engine());
+    return random_below(max_ex);
 }
 
 inline double random_float(double min, double max) {
-    std::uniform_real_distribution<double> dist(min, max);
-    return dist(get_random_engine());
+    // The top 53 bits, as a double in [0, 1).
+    double unit = (get_random_engine()() >> 11) * (1.0 / (uint64_t{1} << 53));
+    return min + (max - min) * unit;
 }